@@ -0,0 +1,92 @@
+#include "arena.h"
+
+typedef struct
+{
+    char * data;
+    size_t size;
+} ArenaBlock;
+
+typedef struct
+{
+    ArenaBlock * blocks;
+    int count;
+    int capacity;
+
+    // The block being bumped through (-1 before the first allocation), and
+    // how much of it is handed out.
+    int current;
+    size_t used;
+} Arena;
+
+static Arena arena = { NULL, 0, 0, -1, 0 };
+
+#define ARENA_ALIGNMENT alignof(std::max_align_t)
+
+static void free_blocks_after(int block)
+{
+    for (int i = block + 1; i < arena.count; i++) free(arena.blocks[i].data);
+    if (arena.count > block + 1) arena.count = block + 1;
+}
+
+void * arena_allocate(size_t size)
+{
+    size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+
+    if (arena.current >= 0 && size <= arena.blocks[arena.current].size - arena.used)
+    {
+        void * result = arena.blocks[arena.current].data + arena.used;
+        arena.used += size;
+        return result;
+    }
+
+    // Move on to the next block, reusing it when it is kept from before and
+    // large enough. A request larger than a block gets a block of its own.
+    int next = arena.current + 1;
+    if (next < arena.count && arena.blocks[next].size < size) free_blocks_after(next - 1);
+
+    if (next == arena.count)
+    {
+        if (arena.capacity < arena.count + 1)
+        {
+            arena.capacity = arena.capacity < 8 ? 8 : 2 * arena.capacity;
+            arena.blocks = (ArenaBlock *)realloc(arena.blocks, sizeof(ArenaBlock) * arena.capacity);
+            if (arena.blocks == NULL) exit(1);
+        }
+
+        ArenaBlock * block = &arena.blocks[arena.count++];
+        block->size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block->data = (char *)malloc(block->size);
+        if (block->data == NULL) exit(1);
+    }
+
+    arena.current = next;
+    arena.used = size;
+    return arena.blocks[next].data;
+}
+
+ArenaMark arena_mark()
+{
+    ArenaMark mark = { arena.current, arena.used };
+    return mark;
+}
+
+// Blocks past the mark are freed, except the first, which is kept so that
+// compiling many small programs (REPL lines) allocates nothing.
+void arena_release(ArenaMark mark)
+{
+    free_blocks_after(mark.block > 0 ? mark.block : 0);
+
+    arena.current = mark.block;
+    arena.used = mark.used;
+}
+
+void free_arena()
+{
+    free_blocks_after(-1);
+    free(arena.blocks);
+
+    arena.blocks = NULL;
+    arena.capacity = 0;
+    arena.current = -1;
+    arena.used = 0;
+}
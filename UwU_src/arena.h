@@ -0,0 +1,50 @@
+#ifndef ARENA_H_INCLUDED
+#define ARENA_H_INCLUDED
+
+#include <vector>
+#include <unordered_map>
+
+#include "common.h"
+
+// Bump allocator for data that only lives while a function is compiled: the
+// compiler's locals and constant index, and the instruction lists the
+// optimizer and the register translator work on. Nothing is freed on its
+// own; arena_release() drops everything allocated since a mark at once.
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct
+{
+    int block;
+    size_t used;
+} ArenaMark;
+
+void * arena_allocate(size_t);
+ArenaMark arena_mark();
+void arena_release(ArenaMark);
+void free_arena();
+
+// Lets standard containers allocate from the arena. Freeing is a no-op, so
+// a container must be emptied or gone before its memory is released.
+template <typename T>
+class ArenaAllocator
+{
+    public:
+        typedef T value_type;
+
+        ArenaAllocator() {}
+        template <typename U> ArenaAllocator(const ArenaAllocator<U> &) {}
+
+        T * allocate(size_t count) { return (T *)arena_allocate(sizeof(T) * count); }
+        void deallocate(T *, size_t) {}
+
+        template <typename U> bool operator==(const ArenaAllocator<U> &) const { return true;  }
+        template <typename U> bool operator!=(const ArenaAllocator<U> &) const { return false; }
+};
+
+template <typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+template <typename K, typename V>
+using ArenaMap = std::unordered_map<K, V, std::hash<K>, std::equal_to<K>, ArenaAllocator<std::pair<const K, V>>>;
+
+#endif // ARENA_H_INCLUDED
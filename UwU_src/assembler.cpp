@@ -0,0 +1,465 @@
+#include "assembler.h"
+
+bool is_jump(uint8_t op)
+{
+    switch (op)
+    {
+        case OP_JUMP:
+        case OP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+            return true;
+
+        default:
+            return is_compare_jump(op);
+    }
+}
+
+bool is_compare_jump(uint8_t op)
+{
+    return op >= OP_JUMP_IF_EQUAL && op <= OP_JUMP_IF_NOT_LESS_EQUAL;
+}
+
+// Width in bytes of the short (non-OP_WIDE) operand of an instruction.
+static int operand_width(uint8_t op)
+{
+    switch (op)
+    {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_POPN:
+            return 1;
+
+        // Slot in the high byte, constant index in the low byte.
+        case OP_INCREMENT_LOCAL:
+
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_JUMP:
+        case OP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+            return 2;
+
+        default:
+            return is_compare_jump(op) ? 2 : 0;
+    }
+}
+
+void decode_chunk(Chunk * chunk, Code & code, const LongJumps * long_jumps)
+{
+    uint8_t * bytes = chunk->ccode();
+    int count = chunk->ccount();
+
+    // Sized up front, as a list that grows in the arena leaves its old
+    // copies behind.
+    int instructions = 0;
+    for (int offset = 0; offset < count; instructions++)
+    {
+        offset += bytes[offset] == OP_WIDE ? 5 : 1 + operand_width(bytes[offset]);
+    }
+
+    code.clear();
+    code.reserve(instructions);
+    // Freed before decoding returns, unlike the lists kept in the arena.
+    std::vector<int> index_at(count + 1, -1);
+
+    for (int offset = 0; offset < count;)
+    {
+        Instruction instruction;
+        int start = offset;
+        index_at[start] = (int)code.size();
+
+        instruction.line = chunk->get_line(start);
+        instruction.op = bytes[offset++];
+
+        if (instruction.op == OP_WIDE)
+        {
+            instruction.op = bytes[offset++];
+            instruction.operand = (bytes[offset] << 16) | (bytes[offset + 1] << 8) | bytes[offset + 2];
+            offset += 3;
+        }
+        else
+        {
+            switch (operand_width(instruction.op))
+            {
+                case 1: instruction.operand = bytes[offset]; break;
+                case 2: instruction.operand = (bytes[offset] << 8) | bytes[offset + 1]; break;
+                default: instruction.operand = 0; break;
+            }
+            offset += operand_width(instruction.op);
+        }
+
+        // Jump operands are turned into absolute byte offsets here and into
+        // instruction indices once every instruction start is known.
+        if (is_jump(instruction.op))
+        {
+            LongJumps::const_iterator _iterator;
+            if (long_jumps != NULL && (_iterator = long_jumps->find(start)) != long_jumps->end())
+            {
+                instruction.operand = _iterator->second;
+            }
+            else if (instruction.op == OP_LOOP)
+            {
+                instruction.operand = offset - instruction.operand;
+            }
+            else
+            {
+                instruction.operand = offset + instruction.operand;
+            }
+        }
+
+        code.push_back(instruction);
+    }
+
+    index_at[count] = (int)code.size();
+
+    for (Instruction & instruction : code)
+    {
+        if (is_jump(instruction.op)) instruction.operand = index_at[instruction.operand];
+    }
+}
+
+static bool fits_short(Instruction & instruction)
+{
+    switch (operand_width(instruction.op))
+    {
+        case 1:  return instruction.operand <= UINT8_MAX;
+        case 2:  return instruction.operand <= UINT16_MAX;
+        default: return true;
+    }
+}
+
+void encode_chunk(Code & code, Chunk * chunk)
+{
+    int n = (int)code.size();
+    ArenaVector<bool> wide(n, false);
+    ArenaVector<int> offsets(n + 1, 0);
+
+    for (int i = 0; i < n; i++)
+    {
+        if (!is_jump(code[i].op)) wide[i] = !fits_short(code[i]);
+    }
+
+    // Start with every jump short and widen the ones that do not reach;
+    // widening only ever moves code apart, so this settles quickly.
+    bool changed = true;
+    while (changed)
+    {
+        changed = false;
+
+        for (int i = 0; i < n; i++)
+        {
+            int size = wide[i] ? 5 : 1 + operand_width(code[i].op);
+            offsets[i + 1] = offsets[i] + size;
+        }
+
+        for (int i = 0; i < n; i++)
+        {
+            if (!is_jump(code[i].op) || wide[i]) continue;
+
+            int distance = offsets[code[i].operand] - offsets[i + 1];
+            if (distance < 0) distance = -distance;
+
+            if (distance > UINT16_MAX)
+            {
+                wide[i] = true;
+                changed = true;
+            }
+        }
+    }
+
+    chunk->reset_code();
+
+    for (int i = 0; i < n; i++)
+    {
+        Instruction & instruction = code[i];
+        uint8_t op = instruction.op;
+        int operand = instruction.operand;
+
+        if (is_jump(op))
+        {
+            operand = offsets[instruction.operand] - offsets[i + 1];
+            if (op == OP_JUMP || op == OP_LOOP) op = operand < 0 ? OP_LOOP : OP_JUMP;
+            if (operand < 0) operand = -operand;
+        }
+
+        if (wide[i])
+        {
+            chunk->write(OP_WIDE, instruction.line);
+            chunk->write(op, instruction.line);
+            chunk->write((operand >> 16) & 0xff, instruction.line);
+            chunk->write((operand >> 8) & 0xff, instruction.line);
+            chunk->write(operand & 0xff, instruction.line);
+            continue;
+        }
+
+        chunk->write(op, instruction.line);
+        if (operand_width(op) == 2)
+        {
+            chunk->write((operand >> 8) & 0xff, instruction.line);
+            chunk->write(operand & 0xff, instruction.line);
+        }
+        else if (operand_width(op) == 1)
+        {
+            chunk->write(operand & 0xff, instruction.line);
+        }
+    }
+}
+
+void relax_jumps(Chunk * chunk, const LongJumps & long_jumps)
+{
+    Code code;
+    decode_chunk(chunk, code, &long_jumps);
+    encode_chunk(code, chunk);
+}
+
+// Stack depth after 'instruction', given the depth before it.
+static int depth_after(Instruction & instruction, int depth)
+{
+    switch (instruction.op)
+    {
+        case OP_CONSTANT:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_NULL:
+        case OP_GET_GLOBAL:
+        case OP_GET_LOCAL:
+        case OP_READ_STRING:
+        case OP_READ_NUMBER:
+        case OP_READ_CHAR:
+            return depth + 1;
+
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_PRINT:
+            return depth - 1;
+
+        case OP_POPN:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return depth - instruction.operand;
+
+        case OP_JUMP:
+        case OP_LOOP:
+        case OP_OUT:
+        case OP_SET_GLOBAL:
+        case OP_SET_LOCAL:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_NEW_LINE:
+        case OP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_FALSE:
+        case OP_INCREMENT_LOCAL:
+            return depth;
+
+        default:
+            return is_compare_jump(instruction.op) ? depth - 2 : depth - 1;
+    }
+}
+
+static bool falls_through(uint8_t op)
+{
+    return op != OP_JUMP && op != OP_LOOP && op != OP_OUT;
+}
+
+ArenaVector<int> stack_depths(Code & code, int entry)
+{
+    int n = (int)code.size();
+    ArenaVector<int> depth(n + 1, -1);
+    ArenaVector<int> work;
+
+    depth[0] = entry;
+    work.push_back(0);
+
+    while (!work.empty())
+    {
+        int i = work.back();
+        work.pop_back();
+        if (i >= n) continue;
+
+        Instruction & instruction = code[i];
+        int after = depth_after(instruction, depth[i]);
+
+        int successors[2];
+        int successor_count = 0;
+        if (falls_through(instruction.op)) successors[successor_count++] = i + 1;
+        if (is_jump(instruction.op)) successors[successor_count++] = instruction.operand;
+
+        for (int j = 0; j < successor_count; j++)
+        {
+            int successor = successors[j];
+            if (depth[successor] != -1) continue;
+            depth[successor] = after;
+            work.push_back(successor);
+        }
+    }
+
+    return depth;
+}
+
+// Whether a wide form of 'op' exists in the VM.
+static bool has_wide_form(uint8_t op)
+{
+    switch (op)
+    {
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_POPN:
+        case OP_INCREMENT_LOCAL:
+            return false;
+
+        default:
+            return op < OP_COUNT && op != OP_WIDE && operand_width(op) > 0;
+    }
+}
+
+// Decodes code that did not come from the compiler, rejecting truncated or
+// unknown instructions and jumps that do not land on an instruction.
+static bool decode_untrusted(Chunk * chunk, Code & code)
+{
+    uint8_t * bytes = chunk->ccode();
+    int count = chunk->ccount();
+    std::vector<int> index_at(count, -1);
+
+    for (int offset = 0; offset < count;)
+    {
+        Instruction instruction;
+        int start = offset;
+        index_at[start] = (int)code.size();
+
+        instruction.op = bytes[offset++];
+        instruction.line = 0;
+
+        if (instruction.op == OP_WIDE)
+        {
+            if (count - offset < 4 || !has_wide_form(bytes[offset])) return false;
+
+            instruction.op = bytes[offset++];
+            instruction.operand = (bytes[offset] << 16) | (bytes[offset + 1] << 8) | bytes[offset + 2];
+            offset += 3;
+        }
+        else
+        {
+            int width = operand_width(instruction.op);
+            if (instruction.op >= OP_COUNT || count - offset < width) return false;
+
+            switch (width)
+            {
+                case 1: instruction.operand = bytes[offset]; break;
+                case 2: instruction.operand = (bytes[offset] << 8) | bytes[offset + 1]; break;
+                default: instruction.operand = 0; break;
+            }
+            offset += width;
+        }
+
+        if (is_jump(instruction.op))
+        {
+            int target = instruction.op == OP_LOOP ? offset - instruction.operand : offset + instruction.operand;
+            if (target < 0 || target >= count) return false;
+            instruction.operand = target;
+        }
+
+        code.push_back(instruction);
+    }
+
+    for (Instruction & instruction : code)
+    {
+        if (!is_jump(instruction.op)) continue;
+
+        instruction.operand = index_at[instruction.operand];
+        if (instruction.operand == -1) return false;
+    }
+
+    return true;
+}
+
+static bool verify_code(Chunk * chunk, int entry, int max_stack, int global_count)
+{
+    Code code;
+    if (chunk->ccount() == 0 || !decode_untrusted(chunk, code)) return false;
+
+    int n = (int)code.size();
+    int constant_count = chunk->cconstants().vcount();
+    if (entry < 1 || entry > max_stack) return false;
+
+    ArenaVector<int> depth(n, -1);
+    ArenaVector<int> work;
+
+    depth[0] = entry;
+    work.push_back(0);
+
+    while (!work.empty())
+    {
+        int i = work.back();
+        work.pop_back();
+
+        Instruction & instruction = code[i];
+        int operand = instruction.operand;
+
+        switch (instruction.op)
+        {
+            case OP_CONSTANT:
+                if (operand >= constant_count) return false;
+                break;
+
+            case OP_GET_GLOBAL:
+            case OP_SET_GLOBAL:
+            case OP_DEFINE_GLOBAL:
+                if (operand >= global_count) return false;
+                break;
+
+            // Locals live below the top of the stack.
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+                if (operand >= depth[i]) return false;
+                break;
+
+            case OP_INCREMENT_LOCAL:
+                if ((operand >> 8) >= depth[i] || (operand & 0xff) >= constant_count) return false;
+                break;
+
+            default:
+                break;
+        }
+
+        // The callee stays in slot 0, so nothing pops below it.
+        int after = depth_after(instruction, depth[i]);
+        if (after < 1 || after > max_stack) return false;
+
+        int successors[2];
+        int successor_count = 0;
+        if (falls_through(instruction.op)) successors[successor_count++] = i + 1;
+        if (is_jump(instruction.op)) successors[successor_count++] = operand;
+
+        for (int j = 0; j < successor_count; j++)
+        {
+            int successor = successors[j];
+            if (successor >= n) return false;
+
+            if (depth[successor] == -1)
+            {
+                depth[successor] = after;
+                work.push_back(successor);
+            }
+            else if (depth[successor] != after)
+            {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+bool verify_chunk(Chunk * chunk, int entry, int max_stack, int global_count)
+{
+    ArenaMark mark = arena_mark();
+    bool verified = verify_code(chunk, entry, max_stack, global_count);
+    arena_release(mark);
+    return verified;
+}
@@ -0,0 +1,43 @@
+#ifndef ASSEMBLER_H_INCLUDED
+#define ASSEMBLER_H_INCLUDED
+
+#include "common.h"
+#include "chunk.h"
+#include "arena.h"
+
+// One decoded instruction. For jumps, 'operand' is the index of the target
+// instruction (which may be one past the last instruction) rather than a
+// byte distance, so instruction lists can be edited freely and re-encoded.
+typedef struct
+{
+    uint8_t op;
+    int operand;
+    int line;
+} Instruction;
+
+// Instruction lists only live while a function is compiled or translated,
+// so they are allocated from the arena.
+typedef ArenaVector<Instruction> Code;
+
+// Jumps whose distance did not fit in 16 bits when the compiler patched them:
+// byte offset of the jump instruction -> byte offset of its target.
+typedef ArenaMap<int, int> LongJumps;
+
+bool is_jump(uint8_t);
+bool is_compare_jump(uint8_t);
+void decode_chunk(Chunk *, Code &, const LongJumps * long_jumps = NULL);
+void encode_chunk(Code &, Chunk *);
+void relax_jumps(Chunk *, const LongJumps &);
+
+// Stack depth before each instruction (and after the last one), or -1 where
+// it is unreachable, given the depth on entry.
+ArenaVector<int> stack_depths(Code &, int);
+
+// Checks code that did not come from the compiler (a loaded cache) before
+// it runs: every instruction is whole and known, operands name existing
+// constants, globals and live locals, jumps land on instructions, and the
+// stack stays between the callee's slot and 'max_stack' without running off
+// the end, given the depth on entry.
+bool verify_chunk(Chunk *, int, int, int);
+
+#endif // ASSEMBLER_H_INCLUDED
@@ -0,0 +1,466 @@
+#include <vector>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+#include "cache.h"
+#include "chunk.h"
+#include "assembler.h"
+#include "memory.h"
+#include "vm.h"
+
+extern VM vm;
+
+int USE_CACHE = 1;
+
+// Bump whenever the bytecode or this layout changes.
+#define CACHE_VERSION 2
+#define CACHE_MAGIC "UwUc"
+#define CACHE_EXTENSION "c"
+
+// Deeper nesting than this is not worth caching (each level holds a stack
+// slot while it loads).
+#define CACHE_MAX_DEPTH 256
+
+#define NO_NAME UINT32_MAX
+
+// Layout, in host byte order:
+//
+//   header    magic, version, OP_COUNT, sizeof(Value), source length and
+//             hash, hash of everything after the header
+//   globals   count, then each name; the code addresses globals by slot
+//   function  arity, max stack, name, code, line runs, constants
+//
+// A function not compiled yet has no code: its code length is 0, followed
+// by the offset of its parameter list in the source and the line there.
+//
+// A constant is a tag byte followed by its payload; a function constant
+// is a nested function.
+//
+// The hashes only catch a stale or damaged cache, so loaded code is not
+// trusted: each function's code is checked by verify_chunk() before the
+// program is used, and a cache that fails is compiled again.
+typedef enum
+{
+    C_NUMBER,
+    C_CHAR,
+    C_TRUE,
+    C_FALSE,
+    C_NULL,
+    C_STRING,
+    C_FUNCTION,
+} ConstantTag;
+
+typedef struct
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t op_count;
+    uint32_t value_size;
+    uint64_t source_length;
+    uint64_t source_hash;
+    uint64_t payload_hash;
+} CacheHeader;
+
+// FNV-1a, 64-bit.
+static uint64_t hash_bytes(const void * data, size_t length)
+{
+    const uint8_t * bytes = (const uint8_t *)data;
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void make_header(CacheHeader * header, const char * source)
+{
+    size_t length = strlen(source);
+
+    memset(header, 0, sizeof(CacheHeader));
+    memcpy(header->magic, CACHE_MAGIC, 4);
+    header->version = CACHE_VERSION;
+    header->op_count = OP_COUNT;
+    header->value_size = sizeof(Value);
+    header->source_length = length;
+    header->source_hash = hash_bytes(source, length);
+}
+
+static char * cache_path(const char * path)
+{
+    size_t length = strlen(path);
+    char * cache = (char *)malloc(length + sizeof(CACHE_EXTENSION) + 4);
+    if (cache == NULL) exit(1);
+
+    memcpy(cache, path, length);
+    memcpy(cache + length, CACHE_EXTENSION, sizeof(CACHE_EXTENSION));
+    return cache;
+}
+
+typedef std::vector<uint8_t> Buffer;
+
+static void put(Buffer & buffer, const void * data, size_t size)
+{
+    const uint8_t * bytes = (const uint8_t *)data;
+    buffer.insert(buffer.end(), bytes, bytes + size);
+}
+
+static void put_u32(Buffer & buffer, uint32_t value)
+{
+    put(buffer, &value, sizeof(value));
+}
+
+static void put_string(Buffer & buffer, String * string)
+{
+    if (string == NULL)
+    {
+        put_u32(buffer, NO_NAME);
+        return;
+    }
+
+    put_u32(buffer, (uint32_t)string->length());
+    put(buffer, string->chars(), string->length());
+}
+
+static bool put_function(Buffer & buffer, const char * source, Function * _function, int depth)
+{
+    if (depth > CACHE_MAX_DEPTH) return false;
+
+    Chunk & chunk = _function->chunk();
+
+    put_u32(buffer, (uint32_t)_function->arity());
+    put_u32(buffer, (uint32_t)_function->max_stack());
+    put_string(buffer, _function->name());
+
+    if (_function->source() != NULL)
+    {
+        size_t offset = _function->source() - source;
+        if (offset > UINT32_MAX) return false;
+
+        put_u32(buffer, 0);
+        put_u32(buffer, (uint32_t)offset);
+        put_u32(buffer, (uint32_t)_function->source_line());
+        return true;
+    }
+
+    put_u32(buffer, (uint32_t)chunk.ccount());
+    put(buffer, chunk.ccode(), chunk.ccount());
+    put_u32(buffer, (uint32_t)chunk.clines().lcount);
+    put(buffer, chunk.clines().runs, sizeof(LineRun) * chunk.clines().lcount);
+
+    ValueArray & constants = chunk.cconstants();
+    put_u32(buffer, (uint32_t)constants.vcount());
+
+    for (int i = 0; i < constants.vcount(); i++)
+    {
+        Value value = constants.vvalues()[i];
+
+        if (IS_NUMBER(value))
+        {
+            double number = AS_NUMBER(value);
+            buffer.push_back(C_NUMBER);
+            put(buffer, &number, sizeof(number));
+        }
+        else if (IS_CHAR(value))
+        {
+            buffer.push_back(C_CHAR);
+            buffer.push_back((uint8_t)AS_CHAR(value));
+        }
+        else if (IS_BOOL(value))
+        {
+            buffer.push_back(AS_BOOL(value) ? C_TRUE : C_FALSE);
+        }
+        else if (IS_NULL(value))
+        {
+            buffer.push_back(C_NULL);
+        }
+        else if (IS_STRING(value))
+        {
+            buffer.push_back(C_STRING);
+            put_string(buffer, AS_STRING(value));
+        }
+        else if (IS_FUNCTION(value))
+        {
+            buffer.push_back(C_FUNCTION);
+            if (!put_function(buffer, source, AS_FUNCTION(value), depth + 1)) return false;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Writes the cache for 'path' through a temporary file of this process's
+// own and a rename, so concurrent runs neither write into each other's file
+// nor see half a cache. Failing to write (a read-only
+// directory, say) is not an error: the next run just compiles again.
+void save_cache(const char * path, const char * source, Function * _function)
+{
+    Buffer buffer;
+
+    CacheHeader header;
+    make_header(&header, source);
+    put(buffer, &header, sizeof(header));
+
+    put_u32(buffer, (uint32_t)vm.global_names.vcount());
+    for (int i = 0; i < vm.global_names.vcount(); i++)
+    {
+        put_string(buffer, AS_STRING(vm.global_names.vvalues()[i]));
+    }
+
+    if (!put_function(buffer, source, _function, 0)) return;
+
+    header.payload_hash = hash_bytes(buffer.data() + sizeof(header), buffer.size() - sizeof(header));
+    memcpy(buffer.data(), &header, sizeof(header));
+
+    char * cache = cache_path(path);
+    std::string temporary = std::string(cache) + "." + std::to_string(getpid()) + ".tmp";
+
+    FILE * file = fopen(temporary.c_str(), "wb");
+    if (file != NULL)
+    {
+        bool written = fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+        written = fclose(file) == 0 && written;
+
+        if (!written || rename(temporary.c_str(), cache) != 0) remove(temporary.c_str());
+    }
+
+    free(cache);
+}
+
+typedef struct
+{
+    const uint8_t * current;
+    const uint8_t * end;
+    bool failed;
+
+    // The script the cache was written from, which stubs point into.
+    const char * source;
+    size_t source_length;
+} Reader;
+
+static const uint8_t * read_bytes(Reader * reader, size_t size)
+{
+    if (reader->failed || (size_t)(reader->end - reader->current) < size)
+    {
+        reader->failed = true;
+        return NULL;
+    }
+
+    const uint8_t * data = reader->current;
+    reader->current += size;
+    return data;
+}
+
+static uint32_t read_u32(Reader * reader)
+{
+    uint32_t value = 0;
+    const uint8_t * data = read_bytes(reader, sizeof(value));
+    if (data != NULL) memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+// Interned like any other string; 'is_null' is set for a missing name.
+static String * read_string(Reader * reader, bool * is_null)
+{
+    uint32_t length = read_u32(reader);
+    *is_null = length == NO_NAME;
+    if (*is_null || reader->failed) return NULL;
+
+    const uint8_t * chars = read_bytes(reader, length);
+    if (chars == NULL) return NULL;
+
+    return copy_string((const char *)chars, (int)length);
+}
+
+// Builds the function on top of the VM stack, where it stays reachable
+// while its strings and nested functions are allocated.
+static Function * read_function(Reader * reader, int depth)
+{
+    if (depth > CACHE_MAX_DEPTH) reader->failed = true;
+    if (reader->failed) return NULL;
+
+    Function * _function = new_function();
+    push(OBJECT_VAL(_function));
+
+    uint32_t arity = read_u32(reader);
+    uint32_t max_stack = read_u32(reader);
+    if (arity > UINT8_MAX || max_stack > INT32_MAX) reader->failed = true;
+
+    _function->arity() = (int)arity;
+    _function->max_stack() = (int)max_stack;
+
+    bool is_null;
+    _function->name() = read_string(reader, &is_null);
+
+    uint32_t count = read_u32(reader);
+    if (count == 0 && !reader->failed)
+    {
+        uint32_t offset = read_u32(reader);
+        _function->source_line() = (int)read_u32(reader);
+
+        if (reader->failed || offset >= reader->source_length || _function->source_line() <= 0)
+        {
+            reader->failed = true;
+            pop();
+            return NULL;
+        }
+
+        _function->source() = reader->source + offset;
+        return _function;
+    }
+
+    const uint8_t * code = read_bytes(reader, count);
+    uint32_t run_count = read_u32(reader);
+    const uint8_t * runs = read_bytes(reader, sizeof(LineRun) * (size_t)run_count);
+
+    if (reader->failed || count == 0 || run_count == 0 || count > INT32_MAX || run_count > count)
+    {
+        reader->failed = true;
+        pop();
+        return NULL;
+    }
+
+    // Runs are copied as raw bytes, so their alignment in the file does
+    // not matter.
+    _function->chunk().set_code(code, (int)count, (const LineRun *)(const void *)runs, (int)run_count);
+
+    uint32_t constant_count = read_u32(reader);
+    for (uint32_t i = 0; i < constant_count && !reader->failed; i++)
+    {
+        const uint8_t * tag = read_bytes(reader, 1);
+        if (tag == NULL) break;
+
+        Value value = NULL_VAL;
+        switch (*tag)
+        {
+            case C_NUMBER:
+            {
+                double number;
+                const uint8_t * data = read_bytes(reader, sizeof(number));
+                if (data == NULL) break;
+                memcpy(&number, data, sizeof(number));
+                value = NUMBER_VAL(number);
+                break;
+            }
+            case C_CHAR:
+            {
+                const uint8_t * data = read_bytes(reader, 1);
+                if (data != NULL) value = CHAR_VAL((char)*data);
+                break;
+            }
+            case C_TRUE:  value = BOOL_VAL(true);  break;
+            case C_FALSE: value = BOOL_VAL(false); break;
+            case C_NULL:  value = NULL_VAL;        break;
+
+            case C_STRING:
+            {
+                String * string = read_string(reader, &is_null);
+                if (is_null) reader->failed = true;
+                else if (string != NULL) value = OBJECT_VAL(string);
+                break;
+            }
+            case C_FUNCTION:
+            {
+                Function * nested = read_function(reader, depth + 1);
+                if (nested != NULL)
+                {
+                    value = OBJECT_VAL(nested);
+                    pop();
+                }
+                break;
+            }
+
+            default:
+                reader->failed = true;
+                break;
+        }
+
+        if (!reader->failed) _function->chunk().add_constant(value);
+    }
+
+    if (!reader->failed && !verify_chunk(&_function->chunk(), _function->arity() + 1,
+                                         _function->max_stack(), vm.global_values.vcount()))
+    {
+        reader->failed = true;
+    }
+
+    if (reader->failed)
+    {
+        pop();
+        return NULL;
+    }
+
+    return _function;
+}
+
+// The program in 'data', or NULL when it was not written from 'source' by
+// this build. The function is left on the VM stack.
+static Function * parse_cache(const uint8_t * data, size_t size, const char * source)
+{
+    Reader reader = { data, data + size, false, source, strlen(source) };
+
+    CacheHeader expected;
+    make_header(&expected, source);
+
+    // Everything but the payload hash must match exactly; the payload hash
+    // catches a cache damaged on disk.
+    const uint8_t * header = read_bytes(&reader, sizeof(CacheHeader));
+    if (header == NULL) return NULL;
+
+    expected.payload_hash = hash_bytes(reader.current, reader.end - reader.current);
+    if (memcmp(header, &expected, sizeof(CacheHeader)) != 0) return NULL;
+
+    // Slots were handed out in this order when the program was compiled;
+    // a fresh VM hands them out the same way, which is checked here.
+    uint32_t global_count = read_u32(&reader);
+    for (uint32_t i = 0; i < global_count && !reader.failed; i++)
+    {
+        bool is_null;
+        String * name = read_string(&reader, &is_null);
+        if (is_null || name == NULL || global_slot(name) != (int)i) reader.failed = true;
+    }
+
+    Function * _function = read_function(&reader, 0);
+    if (_function != NULL && reader.current != reader.end)
+    {
+        pop();
+        return NULL;
+    }
+
+    return _function;
+}
+
+Function * load_cache(const char * path, const char * source)
+{
+    char * cache = cache_path(path);
+    FILE * file = fopen(cache, "rb");
+    free(cache);
+    if (file == NULL) return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+
+    Function * _function = NULL;
+    uint8_t * data = size > 0 ? (uint8_t *)malloc(size) : NULL;
+
+    if (data != NULL && fread(data, 1, size, file) == (size_t)size)
+    {
+        _function = parse_cache(data, size, source);
+        if (_function != NULL) pop();
+    }
+
+    free(data);
+    fclose(file);
+    return _function;
+}
@@ -0,0 +1,14 @@
+#ifndef CACHE_H_INCLUDED
+#define CACHE_H_INCLUDED
+
+#include "common.h"
+#include "object.h"
+
+// Compiled programs are cached next to their script ('script.uwu' ->
+// 'script.uwuc'). A cache is only used when it was written by this format
+// version from exactly the same source; otherwise the script is compiled
+// and the cache rewritten.
+Function * load_cache(const char *, const char *);
+void save_cache(const char *, const char *, Function *);
+
+#endif // CACHE_H_INCLUDED
@@ -1,41 +1,53 @@
 #include "chunk.h"
 #include "memory.h"
+#include "vm.h"
 
-void Chunk::write(uint8_t byte, int line)
+// Starts a new run at 'offset' unless the last run is already for 'line'.
+void add_line_run(Lines & lines, int offset, int line)
 {
-    if (_capacity < _count + 1)
+    if (lines.lcount > 0 && lines.runs[lines.lcount - 1].line == line) return;
+
+    if (lines.lcapacity < lines.lcount + 1)
     {
-        int old_capacity = _capacity;
+        int old_capacity = lines.lcapacity;
 
-        _capacity = GROW_CAPACITY(old_capacity);
-        _code = GROW_ARRAY(uint8_t, _code, _capacity);
+        lines.lcapacity = GROW_CAPACITY(old_capacity);
+        lines.runs = GROW_ARRAY(LineRun, lines.runs, old_capacity, lines.lcapacity);
     }
 
-    if (_lines.lcapacity < _lines.lcount + 2)
-    {
-        int old_capacity = _lines.lcapacity;
-
-        _lines.lcapacity = GROW_CAPACITY(old_capacity);
-        _lines.lines = GROW_ARRAY(int *, _lines.lines, _lines.lcapacity);
+    lines.runs[lines.lcount].offset = offset;
+    lines.runs[lines.lcount].line = line;
+    lines.lcount++;
+}
 
-        for (int i = old_capacity; i < _lines.lcapacity; i++)
-        {
-            _lines.lines[i] = GROW_ARRAY(int, NULL, 2);
-            _lines.lines[i][0] = 1;
-            _lines.lines[i][1] = 0;
-        }
-    }
+// Binary search for the last run starting at or before 'offset'.
+int find_line(Lines & lines, int offset)
+{
+    if (lines.lcount == 0) return 0;
 
-    if (line == _lines.lines[_lines.lcount][0])
+    int low = 0, high = lines.lcount - 1;
+    while (low < high)
     {
-        _lines.lines[_lines.lcount][1]++;
+        int middle = low + (high - low + 1) / 2;
+        if (lines.runs[middle].offset <= offset) low = middle;
+        else high = middle - 1;
     }
-    else
+
+    return lines.runs[low].line;
+}
+
+void Chunk::write(uint8_t byte, int line)
+{
+    if (_capacity < _count + 1)
     {
-        _lines.lines[++_lines.lcount][0] = line;
-        _lines.lines[_lines.lcount][1] = _lines.lines[_lines.lcount - 1][1] + 1;
+        int old_capacity = _capacity;
+
+        _capacity = GROW_CAPACITY(old_capacity);
+        _code = GROW_ARRAY(uint8_t, _code, old_capacity, _capacity);
     }
 
+    add_line_run(_lines, _count, line);
+
     _code[_count] = byte;
     _count++;
 }
@@ -43,26 +55,64 @@ void Chunk::write(uint8_t byte, int line)
 void Chunk::init()
 {
     _count = _capacity = 0;
-    _lines.lcount = _lines.lcapacity = _lines.lindex = 0;
+    _lines.lcount = _lines.lcapacity = 0;
     _code = NULL;
-    _lines.lines = {NULL};
+    _lines.runs = NULL;
     _constants.init();
 }
 
-void Chunk::free()
+void Chunk::reset_code()
+{
+    FREE_ARRAY(uint8_t, _code, _capacity);
+    FREE_ARRAY(LineRun, _lines.runs, _lines.lcapacity);
+
+    _count = _capacity = 0;
+    _lines.lcount = _lines.lcapacity = 0;
+    _code = NULL;
+    _lines.runs = NULL;
+}
+
+// Replaces the code and line table with copies of the given arrays, sized
+// exactly (used when loading a compiled program).
+void Chunk::set_code(const uint8_t * code, int count, const LineRun * runs, int run_count)
 {
-    FREE_ARRAY(uint8_t, _code);
-    for (int i = 0; i < _lines.lcapacity; i++)
+    reset_code();
+
+    _code = GROW_ARRAY(uint8_t, NULL, 0, count);
+    memcpy(_code, code, count);
+    _count = _capacity = count;
+
+    _lines.runs = GROW_ARRAY(LineRun, NULL, 0, run_count);
+    memcpy(_lines.runs, runs, sizeof(LineRun) * run_count);
+    _lines.lcount = _lines.lcapacity = run_count;
+}
+
+// Drops the code from 'count' onwards, along with its line runs.
+void Chunk::truncate(int count)
+{
+    _count = count;
+    while (_lines.lcount > 0 && _lines.runs[_lines.lcount - 1].offset >= count)
     {
-        FREE_ARRAY(int, _lines.lines[i]);
+        _lines.lcount--;
     }
-    FREE_ARRAY(int *, _lines.lines);
+}
+
+void Chunk::free()
+{
+    reset_code();
     _constants.free();
     init();
 }
 
+int Chunk::get_line(int offset)
+{
+    return find_line(_lines, offset);
+}
+
 int Chunk::add_constant(Value value)
 {
+    push(value);
     _constants.write(value);
+    pop();
     return _constants.vcount() - 1;
 }
@@ -49,18 +49,63 @@ typedef enum
     OP_NULL,
 
     OP_CALL,
+    OP_TAIL_CALL,
 
     OP_OUT,
+
+    // Superinstructions, only produced by the peephole optimizer.
+    OP_INCREMENT_LOCAL,
+    OP_POPN,
+    OP_JUMP_IF_EQUAL,
+    OP_JUMP_IF_NOT_EQUAL,
+    OP_JUMP_IF_GREATER,
+    OP_JUMP_IF_NOT_GREATER,
+    OP_JUMP_IF_GREATER_EQUAL,
+    OP_JUMP_IF_NOT_GREATER_EQUAL,
+    OP_JUMP_IF_LESS,
+    OP_JUMP_IF_NOT_LESS,
+    OP_JUMP_IF_LESS_EQUAL,
+    OP_JUMP_IF_NOT_LESS_EQUAL,
+
+    // Quickened forms: a generic arithmetic or comparison instruction
+    // rewrites itself into one of these once it sees two numbers, and
+    // rewrites itself back on the first operand that is not a number.
+    OP_ADD_NUMBER,
+    OP_SUBTRACT_NUMBER,
+    OP_MULTIPLY_NUMBER,
+    OP_DIVIDE_NUMBER,
+    OP_GREATER_NUMBER,
+    OP_GREATER_EQUAL_NUMBER,
+    OP_LESS_NUMBER,
+    OP_LESS_EQUAL_NUMBER,
+
+    // Prefix: the next opcode takes a 24-bit operand instead of its usual
+    // 8- or 16-bit one (constants, locals, globals and jumps).
+    OP_WIDE,
+
+    OP_COUNT,
 } OpCode;
 
+const char * opcode_name(uint8_t);
+
+// Bytes from 'offset' up to the next run's offset were compiled from 'line'.
+typedef struct
+{
+    int offset;
+    int line;
+} LineRun;
+
+// Run-length line table: one contiguous array of runs sorted by offset.
 typedef struct
 {
     int lcount;
     int lcapacity;
-    int lindex;
-    int ** lines;
+    LineRun * runs;
 } Lines;
 
+void add_line_run(Lines &, int, int);
+int find_line(Lines &, int);
+
 class Chunk
 {
     private:
@@ -74,19 +119,23 @@ class Chunk
         int ccount()            { return _count;     }
         int ccapacity()         { return _capacity;  }
         uint8_t * ccode()       { return _code;      }
-        Lines clines()          { return _lines;     }
-        ValueArray cconstants() { return _constants; }
+        Lines & clines()        { return _lines;     }
+        ValueArray & cconstants() { return _constants; }
 
         Chunk() : _count(0), _capacity(0), _code(NULL)
         {
-            _lines.lcapacity = _lines.lcount = _lines.lindex = 0;
-            _lines.lines = {NULL};
+            _lines.lcapacity = _lines.lcount = 0;
+            _lines.runs = NULL;
         }
 
         void init();
         void write(uint8_t, int);
+        void reset_code();
+        void set_code(const uint8_t *, int, const LineRun *, int);
+        void truncate(int);
         void free();
         int add_constant(Value);
+        int get_line(int);
 
         void disassemble(const char *);
         int disassemble_instruction(int);
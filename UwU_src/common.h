@@ -11,8 +11,23 @@
 #include <stdexcept>
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
+#define UINT24_MAX ((1 << 24) - 1)
+
+// Packs every Value into a single 8-byte double; comment out to fall back to
+// the 16-byte tagged union.
+#define NAN_BOXING
+
+// Dispatch the interpreter loop through a table of label addresses (GCC and
+// Clang only); other compilers fall back to the switch.
+#if defined(__GNUC__)
+#define COMPUTED_GOTO
+#endif
 
 //#define DEBUG_PRINT_CODE
 //#define DEBUG_TRACE_EXECUTION
 
+//#define DEBUG_STRESS_GC
+//#define DEBUG_LOG_GC
+
 #endif // COMMON_H_INCLUDED
@@ -1,9 +1,18 @@
 #include "common.h"
 #include "compiler.h"
 #include "scanner.h"
+#include "memory.h"
+#include "arena.h"
+#include "assembler.h"
+#include "optimizer.h"
+#include "output.h"
 
 int DEBUG_PRINT_CODE = 0;
 int DEBUG_TRACE_EXECUTION = 0;
+int OPTIMIZE_CODE = 1;
+int LAZY_COMPILE = 1;
+
+extern int REGISTER_VM;
 
 typedef struct
 {
@@ -54,24 +63,41 @@ class Compiler
     private:
         Compiler * _enclosing;
         int _local_count;
+        int _local_capacity;
         int _scope_depth;
-        Local _locals[UINT8_COUNT];
+        Local * _locals;
         Function * _function;
         FunType _type;
+        ArenaMap<uint64_t, int> _constant_index;
+        LongJumps _long_jumps;
+        ArenaMark _arena_mark;
 
     public:
         Compiler * & enlosing()   { return _enclosing;   }
 
-        int & local_count()       { return _local_count; }
-        int & scope_depth()       { return _scope_depth; }
-        Local * locals()          { return _locals;      }
+        int & local_count()       { return _local_count;    }
+        int & local_capacity()    { return _local_capacity; }
+        int & scope_depth()       { return _scope_depth;    }
+        Local * & locals()        { return _locals;         }
         Function * & __function() { return _function;    }
         FunType & ftype()         { return _type;        }
+
+        ArenaMap<uint64_t, int> & constant_index() { return _constant_index; }
+        LongJumps & long_jumps()  { return _long_jumps; }
+        ArenaMark & arena_mark()  { return _arena_mark; }
 };
 
 Parser parser;
 Compiler * current = NULL;
 
+// Chunk offset where the left operand of the infix rule being parsed starts.
+static int operand_start = 0;
+
+// Whether function bodies are left to compile on their first call. '-p'
+// lists every function and the register VM translates the whole program
+// before it runs, so both compile everything up front.
+static bool lazy_bodies = false;
+
 static Chunk * current_chunk()
 {
     return &current->__function()->chunk();
@@ -82,6 +108,7 @@ static void error_at(Token * token, const char * message)
     if (parser.panic_mode) return;
     parser.panic_mode = true;
 
+    flush_output();
     fprintf(stderr, "[line %d] Ewwow", token->line());
 
     if (token->kind() == Kind::T_EOF)
@@ -162,15 +189,47 @@ static void emit_bytes(uint8_t byte1, uint8_t byte2)
     emit_byte(byte2);
 }
 
+static void emit_wide(uint8_t instruction, int operand)
+{
+    emit_byte(OP_WIDE);
+    emit_byte(instruction);
+    emit_byte((operand >> 16) & 0xff);
+    emit_byte((operand >> 8) & 0xff);
+    emit_byte(operand & 0xff);
+}
+
+// Emits an instruction addressing a constant, a local or a global slot. The
+// OP_WIDE form is only used when the index does not fit the short operand.
+static void emit_indexed(uint8_t instruction, int index)
+{
+    bool is_global = instruction == OP_GET_GLOBAL || instruction == OP_SET_GLOBAL || instruction == OP_DEFINE_GLOBAL;
+
+    if (index > (is_global ? UINT16_MAX : UINT8_MAX))
+    {
+        emit_wide(instruction, index);
+        return;
+    }
+
+    emit_byte(instruction);
+    if (is_global) emit_byte((index >> 8) & 0xff);
+    emit_byte(index & 0xff);
+}
+
 static void emit_loop(int loop_start)
 {
-    emit_byte(OP_LOOP);
+    int offset = current_chunk()->ccount() - loop_start + 3;
+    if (offset <= UINT16_MAX)
+    {
+        emit_byte(OP_LOOP);
+        emit_byte((offset >> 8) & 0xff);
+        emit_byte(offset & 0xff);
+        return;
+    }
 
-    int offset = current_chunk()->ccount() - loop_start + 2;
-    if (offset > UINT16_MAX) error("w-woop body is t-too wawge.");
+    offset = current_chunk()->ccount() - loop_start + 5;
+    if (offset > UINT24_MAX) error("w-woop body is t-too wawge.");
 
-    emit_byte((offset >> 8) & 0xff);
-    emit_byte(offset & 0xff);
+    emit_wide(OP_LOOP, offset);
 }
 
 static int emit_jump(uint8_t instruction)
@@ -187,34 +246,94 @@ static void emit_return()
     emit_byte(OP_OUT);
 }
 
-static void init_compiler(Compiler * compiler, FunType type)
+static Local * push_local()
+{
+    if (current->local_capacity() < current->local_count() + 1)
+    {
+        int old_capacity = current->local_capacity();
+        current->local_capacity() = GROW_CAPACITY(old_capacity);
+
+        Local * locals = (Local *)arena_allocate(sizeof(Local) * current->local_capacity());
+        if (old_capacity > 0) memcpy(locals, current->locals(), sizeof(Local) * old_capacity);
+        current->locals() = locals;
+    }
+
+    return &current->locals()[current->local_count()++];
+}
+
+// Compiles into '_function' when given (a stub getting its body), or into a
+// new function named after the previous token.
+static void init_compiler(Compiler * compiler, FunType type, Function * _function = NULL)
 {
     compiler->enlosing() = current;
+    compiler->arena_mark() = arena_mark();
 
     compiler->__function() = NULL;
     compiler->ftype() = type;
     compiler->local_count() = 0;
+    compiler->local_capacity() = 0;
+    compiler->locals() = NULL;
     compiler->scope_depth() = 0;
-    compiler->__function() = new_function();
+    compiler->__function() = _function != NULL ? _function : new_function();
 
     current = compiler;
 
-    if (type != TYPE_SCRIPT)
+    if (type != TYPE_SCRIPT && _function == NULL)
     {
         current->__function()->name() = copy_string(parser.previous.start(), parser.previous.length());
     }
 
-    Local * local = &current->locals()[current->local_count()++];
+    Local * local = push_local();
     local->depth = 0;
     local->name.start() = "";
     local->name.length() = 0;
 }
 
+// Everything the current compiler took from the arena goes back in one step.
+// Its tables are emptied first, as they would still point into it.
+static void release_compiler()
+{
+    ArenaMap<uint64_t, int>().swap(current->constant_index());
+    LongJumps().swap(current->long_jumps());
+
+    arena_release(current->arena_mark());
+}
+
 static Function * end_compiler()
 {
     emit_return();
     Function * _function = current->__function();
 
+    // The instruction lists below are large for a large function, so each
+    // is dropped as soon as it has been used.
+    ArenaMark mark = arena_mark();
+
+    if (OPTIMIZE_CODE && !parser.had_error)
+    {
+        optimize_chunk(current_chunk(), current->long_jumps());
+    }
+    else if (!current->long_jumps().empty())
+    {
+        relax_jumps(current_chunk(), current->long_jumps());
+    }
+    arena_release(mark);
+
+    // The most values the function ever has on the stack, counting the callee
+    // and its arguments, so a call can reserve its whole frame up front.
+    if (!parser.had_error)
+    {
+        Code code;
+        decode_chunk(current_chunk(), code);
+        ArenaVector<int> depth = stack_depths(code, _function->arity() + 1);
+        for (int d : depth)
+        {
+            if (d > _function->max_stack()) _function->max_stack() = d;
+        }
+    }
+    arena_release(mark);
+
+    release_compiler();
+
     if (DEBUG_PRINT_CODE)
     {
         if (!parser.had_error)
@@ -227,31 +346,93 @@ static Function * end_compiler()
     return _function;
 }
 
-static uint8_t make_constant(Value value)
+// Leaves the current function as a stub that compiles when it is first
+// called, from the parameter list at 'source' on 'line'.
+static Function * end_stub(const char * source, int line)
+{
+    Function * _function = current->__function();
+    _function->source() = source;
+    _function->source_line() = line;
+
+    release_compiler();
+
+    current = current->enlosing();
+    return _function;
+}
+
+// Numbers are keyed by their exact bit pattern (so 0 and -0 stay distinct)
+// and interned strings by pointer.
+static uint64_t constant_key(Value value)
+{
+#ifdef NAN_BOXING
+    return value;
+#else
+    if (IS_NUMBER(value))
+    {
+        uint64_t bits;
+        double number = AS_NUMBER(value);
+        memcpy(&bits, &number, sizeof(double));
+        return bits;
+    }
+    if (IS_CHAR(value)) return (uint8_t)AS_CHAR(value);
+    return (uint64_t)(uintptr_t)AS_OBJECT(value);
+#endif
+}
+
+static int find_constant(Value value, uint64_t key)
 {
+    auto _iterator = current->constant_index().find(key);
+    if (_iterator == current->constant_index().end()) return -1;
+
+    Value existing = current_chunk()->cconstants().vvalues()[_iterator->second];
+    if (IS_NUMBER(existing) != IS_NUMBER(value) || IS_CHAR(existing) != IS_CHAR(value)) return -1;
+
+    return _iterator->second;
+}
+
+static int make_constant(Value value)
+{
+    bool shareable = IS_NUMBER(value) || IS_CHAR(value) || IS_STRING(value);
+    uint64_t key = 0;
+
+    if (shareable)
+    {
+        key = constant_key(value);
+        int existing = find_constant(value, key);
+        if (existing != -1) return existing;
+    }
+
     int constant = current_chunk()->add_constant(value);
-    if (constant >UINT8_MAX)
+    if (shareable) current->constant_index().emplace(key, constant);
+
+    if (constant > UINT24_MAX)
     {
         error("too many constwants in one chwnk.");
         return 0;
     }
 
-    return (uint8_t)constant;
+    return constant;
 }
 
 static void emit_constant(Value value)
 {
-    emit_bytes(OP_CONSTANT, make_constant(value));
+    emit_indexed(OP_CONSTANT, make_constant(value));
 }
 
 static void patch_jump(int offset)
 {
     int jump = current_chunk()->ccount() - offset - 2;
 
-    if (jump > UINT16_MAX)
+    if (jump > UINT24_MAX)
     {
         error("too much c-code to jwump ovew.");
     }
+    else if (jump > UINT16_MAX)
+    {
+        // Widened to OP_WIDE by relax_jumps() once the function is complete.
+        current->long_jumps()[offset - 1] = current_chunk()->ccount();
+        return;
+    }
 
     current_chunk()->ccode()[offset] = (jump >> 8) & 0xff;
     current_chunk()->ccode()[offset + 1] = jump & 0xff;
@@ -279,13 +460,108 @@ static void declaration();
 static ParseRule * get_rule(Kind);
 static void parse_precedence(Precedence precedence);
 
+// If the code from 'start' to 'end' is a single literal load, stores the
+// literal in 'value'.
+static bool constant_at(int start, int end, Value * value)
+{
+    uint8_t * code = current_chunk()->ccode();
+    Value * constants = current_chunk()->cconstants().vvalues();
+
+    switch (end - start)
+    {
+        case 1:
+            if (code[start] != OP_TRUE && code[start] != OP_FALSE) return false;
+            *value = BOOL_VAL(code[start] == OP_TRUE);
+            return true;
+
+        case 2:
+            if (code[start] != OP_CONSTANT) return false;
+            *value = constants[code[start + 1]];
+            return true;
+
+        case 5:
+            if (code[start] != OP_WIDE || code[start + 1] != OP_CONSTANT) return false;
+            *value = constants[(code[start + 2] << 16) | (code[start + 3] << 8) | code[start + 4]];
+            return true;
+
+        default: return false;
+    }
+}
+
+// Emits a folded result; booleans have their own opcodes.
+static void emit_literal(Value value)
+{
+    if (IS_BOOL(value)) emit_byte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    else emit_constant(value);
+}
+
+static bool is_text(Value value)
+{
+    return IS_STRING(value) || IS_CHAR(value);
+}
+
+// Evaluates a binary operator on two literals the same way the VM would.
+// Returns false when the operation would be a runtime error, which is then
+// left for the VM to report.
+static bool fold_binary(Kind operator_kind, Value a, Value b, Value * result)
+{
+    switch (operator_kind)
+    {
+        case Kind::T_EQUAL:     *result = BOOL_VAL(values_equal(a, b));  return true;
+        case Kind::T_NOT_EQUAL: *result = BOOL_VAL(!values_equal(a, b)); return true;
+
+        case Kind::T_PLUS:
+            if (is_text(a) && is_text(b))
+            {
+                *result = OBJECT_VAL(concatenate_operands(a, b));
+                return true;
+            }
+            break;
+
+        default: break;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+
+    switch (operator_kind)
+    {
+        case Kind::T_PLUS:  *result = NUMBER_VAL(x + y); return true;
+        case Kind::T_MINUS: *result = NUMBER_VAL(x - y); return true;
+        case Kind::T_STAR:  *result = NUMBER_VAL(x * y); return true;
+        case Kind::T_SLASH: *result = NUMBER_VAL(x / y); return true;
+
+        case Kind::T_GREATER:       *result = BOOL_VAL(x > y);  return true;
+        case Kind::T_GREATER_EQUAL: *result = BOOL_VAL(x >= y); return true;
+        case Kind::T_LESS:          *result = BOOL_VAL(x < y);  return true;
+        case Kind::T_LESS_EQUAL:    *result = BOOL_VAL(x <= y); return true;
+
+        default: return false;
+    }
+}
+
 static void _binary(bool)
 {
     Kind operator_kind = parser.previous.kind();
+    int left_start = operand_start;
+    int right_start = current_chunk()->ccount();
 
     ParseRule * rule = get_rule(operator_kind);
     parse_precedence((Precedence)(rule->precedence + 1));
 
+    // Both operands are literals: replace them with the result.
+    Value a, b, result;
+    if (constant_at(left_start, right_start, &a) &&
+        constant_at(right_start, current_chunk()->ccount(), &b) &&
+        fold_binary(operator_kind, a, b, &result))
+    {
+        current_chunk()->truncate(left_start);
+        emit_literal(result);
+        return;
+    }
+
     switch (operator_kind)
     {
         case Kind::T_PLUS:  emit_byte(OP_ADD);      break;
@@ -375,16 +651,16 @@ static void _tab(bool)
     emit_constant(tab);
 }
 
-static uint8_t identifier_constant(Token * name)
+static int identifier_slot(Token * name)
 {
-    return make_constant(
-                         OBJECT_VAL(
-                                    copy_string(
-                                                name->start(),
-                                                name->length()
-                                                )
-                                    )
-                         );
+    int slot = global_slot(copy_string(name->start(), name->length()));
+    if (slot > UINT24_MAX)
+    {
+        error("too many gwobaw vawiabwes.");
+        return 0;
+    }
+
+    return slot;
 }
 
 static bool identifiers_equal(Token * a, Token * b)
@@ -414,13 +690,13 @@ static int resolve_local(Compiler * compiler, Token * name)
 
 static void add_local(Token name)
 {
-    if (current->local_count() == UINT8_COUNT)
+    if (current->local_count() > UINT24_MAX)
     {
         error("too m-many wocaw v-vawiabwes in scowpe.");
         return;
     }
 
-    Local * local = &current->locals()[current->local_count()++];
+    Local * local = push_local();
     local->name = name;
     local->depth = -1;
 }
@@ -459,7 +735,7 @@ static void named_variable(Token name, bool can_assign, bool read)
     }
     else
     {
-        arg = identifier_constant(&name);
+        arg = identifier_slot(&name);
         get_op = OP_GET_GLOBAL;
         set_op = OP_SET_GLOBAL;
     }
@@ -467,11 +743,11 @@ static void named_variable(Token name, bool can_assign, bool read)
     if (can_assign && (match(Kind::T_ASSIGN) || read))
     {
         if (!read) expression();
-        emit_bytes(set_op, (uint8_t)arg);
+        emit_indexed(set_op, arg);
     }
     else
     {
-        emit_bytes(get_op, (uint8_t)arg);
+        emit_indexed(get_op, arg);
     }
 }
 
@@ -483,9 +759,27 @@ static void _variable(bool can_assign)
 static void _unary(bool)
 {
     Kind operator_kind = parser.previous.kind();
+    int start = current_chunk()->ccount();
 
     parse_precedence(P_UNARY);
 
+    Value value;
+    if (constant_at(start, current_chunk()->ccount(), &value))
+    {
+        if (operator_kind == Kind::T_MINUS && IS_NUMBER(value))
+        {
+            current_chunk()->truncate(start);
+            emit_constant(NUMBER_VAL(-AS_NUMBER(value)));
+            return;
+        }
+        if (operator_kind == Kind::T_NOT)
+        {
+            current_chunk()->truncate(start);
+            emit_literal(BOOL_VAL(is_falsy(value)));
+            return;
+        }
+    }
+
     switch (operator_kind)
     {
         case Kind::T_MINUS: emit_byte(OP_NEGATE); break;
@@ -517,9 +811,14 @@ static uint8_t arg_list()
     return arg_count;
 }
 
+// Offset of the last OP_CALL emitted, so out_statement() can tell whether its
+// expression ends in a call.
+static int last_call = -1;
+
 static void _call(bool)
 {
     uint8_t arg_count = arg_list();
+    last_call = current_chunk()->ccount();
     emit_bytes(OP_CALL, arg_count);
 }
 
@@ -597,12 +896,14 @@ static void parse_precedence(Precedence precedence)
     }
 
     bool can_assign = precedence <= P_ASSIGNMENT;
+    int start = current_chunk()->ccount();
     prefix_rule(can_assign);
 
     while (precedence <= get_rule(parser.current.kind())->precedence)
     {
         advance();
         ParseFn infix_rule = get_rule(parser.previous.kind())->infix;
+        operand_start = start;
         infix_rule(can_assign);
     }
 
@@ -612,14 +913,14 @@ static void parse_precedence(Precedence precedence)
     }
 }
 
-static uint8_t parse_variable(const char * error_message)
+static int parse_variable(const char * error_message)
 {
     consume(Kind::T_IDENTIFIER, error_message);
 
     declare_variable();
     if (current->scope_depth() > 0) return 0;
 
-    return identifier_constant(&parser.previous);
+    return identifier_slot(&parser.previous);
 }
 
 static void mark_initialized()
@@ -628,7 +929,7 @@ static void mark_initialized()
     current->locals()[current->local_count() - 1].depth = current->scope_depth();
 }
 
-static void define_variable(uint8_t global)
+static void define_variable(int global)
 {
     if (current->scope_depth() > 0)
     {
@@ -636,7 +937,7 @@ static void define_variable(uint8_t global)
         return;
     }
 
-    emit_bytes(OP_DEFINE_GLOBAL, global);
+    emit_indexed(OP_DEFINE_GLOBAL, global);
 }
 
 static ParseRule * get_rule(Kind kind)
@@ -659,12 +960,8 @@ static void block()
     consume(Kind::T_BLOCK_END, "':]' expected aftew bwock.");
 }
 
-static void _function(FunType type)
+static void parameters()
 {
-    Compiler compiler;
-    init_compiler(&compiler, type);
-    begin_scope();
-
     consume(Kind::T_LEFT_PAR, "'(' expected aftew fwunction name.");
     if (!check(Kind::T_RIGHT_PAR))
     {
@@ -676,22 +973,60 @@ static void _function(FunType type)
                 error_at_current("can't have mowe than 255 pawametews.");
             }
 
-            uint8_t param_constant = parse_variable("pawamtew name expected.");
-            define_variable(param_constant);
+            int param = parse_variable("pawamtew name expected.");
+            define_variable(param);
         } while (match(Kind::T_COMMA));
     }
     consume(Kind::T_RIGHT_PAR, "')' expected aftew fwunction pawametews.");
+}
 
+// Steps over a function body, matching only its blocks ('[:' or '[' up to
+// ':]'). The rest is checked when the body compiles.
+static void skip_body()
+{
     consume(Kind::T_BLOCK_START, "'[:' expected befowe fwunction body.");
-    block();
 
-    Function * _function = end_compiler();
-    emit_bytes(OP_CONSTANT, make_constant(OBJECT_VAL(_function)));
+    int depth = 1;
+    while (!check(Kind::T_EOF))
+    {
+        if (check(Kind::T_BLOCK_START) || check(Kind::T_LEFT_SQB)) depth++;
+        else if (check(Kind::T_BLOCK_END) && --depth == 0) break;
+
+        advance();
+    }
+
+    consume(Kind::T_BLOCK_END, "':]' expected aftew bwock.");
+}
+
+static void _function(FunType type)
+{
+    Compiler compiler;
+    init_compiler(&compiler, type);
+    begin_scope();
+
+    const char * source = parser.current.start();
+    int line = parser.current.line();
+    parameters();
+
+    Function * _function;
+    if (lazy_bodies)
+    {
+        skip_body();
+        _function = end_stub(source, line);
+    }
+    else
+    {
+        consume(Kind::T_BLOCK_START, "'[:' expected befowe fwunction body.");
+        block();
+        _function = end_compiler();
+    }
+
+    emit_constant(OBJECT_VAL(_function));
 }
 
 static void function_declaration()
 {
-    uint8_t global = parse_variable("fwunction name e-expected.");
+    int global = parse_variable("fwunction name e-expected.");
     mark_initialized();
     _function(TYPE_FUNCTION);
     define_variable(global);
@@ -699,7 +1034,7 @@ static void function_declaration()
 
 static void variable_declaration()
 {
-    uint8_t global = parse_variable("vawiabwe n-name expected.");
+    int global = parse_variable("vawiabwe n-name expected.");
 
     if (match(Kind::T_ASSIGN))
     {
@@ -780,8 +1115,16 @@ static void out_statement()
     }
     else
     {
+        last_call = -1;
         expression();
         consume(Kind::T_OUT_END, "'>>' expected aftew out.");
+
+        // A call that ends the expression is a tail call. The OP_OUT stays
+        // for natives and for paths that jump over the call ('awnd', 'ow').
+        if (last_call == current_chunk()->ccount() - 2)
+        {
+            current_chunk()->ccode()[last_call] = OP_TAIL_CALL;
+        }
         emit_byte(OP_OUT);
     }
 }
@@ -829,6 +1172,7 @@ static void read_statement()
     advance();
     consume(Kind::T_IDENTIFIER, "vawiabwe n-name e-expected aftew wead s-statement.");
     named_variable(parser.previous, true, true);
+    emit_byte(OP_POP);
 
     consume(Kind::T_READ_END, "'<<' expected aftew expwession.");
 }
@@ -905,6 +1249,8 @@ static void statement()
 
 Function * compile(const char * source)
 {
+    lazy_bodies = LAZY_COMPILE && !DEBUG_PRINT_CODE && !REGISTER_VM;
+
     init_scanner(source);
     Compiler compiler;
     init_compiler(&compiler, TYPE_SCRIPT);
@@ -922,3 +1268,55 @@ Function * compile(const char * source)
     Function * _function = end_compiler();
     return parser.had_error ? NULL : _function;
 }
+
+bool compile_function(Function * _function)
+{
+    // A failed attempt leaves part of the body behind.
+    _function->chunk().free();
+
+    init_scanner(_function->source(), _function->source_line());
+
+    parser.had_error = false;
+    parser.panic_mode = false;
+
+    advance();
+
+    Compiler compiler;
+    init_compiler(&compiler, TYPE_FUNCTION, _function);
+    begin_scope();
+
+    _function->arity() = 0;
+    parameters();
+    consume(Kind::T_BLOCK_START, "'[:' expected befowe fwunction body.");
+    block();
+    end_compiler();
+
+    if (parser.had_error) return false;
+
+    _function->source() = NULL;
+    return true;
+}
+
+bool compile_stubs(Function * _function)
+{
+    if (_function->source() != NULL && !compile_function(_function)) return false;
+
+    ValueArray & constants = _function->chunk().cconstants();
+    for (int i = 0; i < constants.vcount(); i++)
+    {
+        Value constant = constants.vvalues()[i];
+        if (IS_FUNCTION(constant) && !compile_stubs(AS_FUNCTION(constant))) return false;
+    }
+
+    return true;
+}
+
+void mark_compiler_roots()
+{
+    Compiler * compiler = current;
+    while (compiler != NULL)
+    {
+        mark_object((Object *)compiler->__function());
+        compiler = compiler->enlosing();
+    }
+}
@@ -6,4 +6,12 @@
 
 Function * compile(const char *);
 
+// A function declared in a script is a stub until it is first called: its
+// parameters are checked but its body is only skipped over. These compile a
+// stub's body in place (reporting any errors), and every stub reachable from
+// a function.
+bool compile_function(Function *);
+bool compile_stubs(Function *);
+void mark_compiler_roots();
+
 #endif // COMPILER_H_INCLUDED
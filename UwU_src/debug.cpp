@@ -1,5 +1,75 @@
 #include "chunk.h"
 #include "value.h"
+#include "vm.h"
+#include "assembler.h"
+
+extern VM vm;
+
+static const char * opcode_names[] =
+{
+    "OP_CONSTANT",
+    "OP_TRUE",
+    "OP_FALSE",
+    "OP_POP",
+    "OP_GET_GLOBAL",
+    "OP_SET_GLOBAL",
+    "OP_GET_LOCAL",
+    "OP_SET_LOCAL",
+    "OP_DEFINE_GLOBAL",
+    "OP_EQUAL",
+    "OP_NOT_EQUAL",
+    "OP_GREATER",
+    "OP_GREATER_EQUAL",
+    "OP_LESS",
+    "OP_LESS_EQUAL",
+    "OP_ADD",
+    "OP_SUBTRACT",
+    "OP_MULTIPLY",
+    "OP_DIVIDE",
+    "OP_NOT",
+    "OP_NEGATE",
+    "OP_PRINT",
+    "OP_READ_STRING",
+    "OP_READ_NUMBER",
+    "OP_READ_CHAR",
+    "OP_NEW_LINE",
+    "OP_JUMP",
+    "OP_JUMP_IF_TRUE",
+    "OP_JUMP_IF_FALSE",
+    "OP_LOOP",
+    "OP_NULL",
+    "OP_CALL",
+    "OP_TAIL_CALL",
+    "OP_OUT",
+    "OP_INCREMENT_LOCAL",
+    "OP_POPN",
+    "OP_JUMP_IF_EQUAL",
+    "OP_JUMP_IF_NOT_EQUAL",
+    "OP_JUMP_IF_GREATER",
+    "OP_JUMP_IF_NOT_GREATER",
+    "OP_JUMP_IF_GREATER_EQUAL",
+    "OP_JUMP_IF_NOT_GREATER_EQUAL",
+    "OP_JUMP_IF_LESS",
+    "OP_JUMP_IF_NOT_LESS",
+    "OP_JUMP_IF_LESS_EQUAL",
+    "OP_JUMP_IF_NOT_LESS_EQUAL",
+    "OP_ADD_NUMBER",
+    "OP_SUBTRACT_NUMBER",
+    "OP_MULTIPLY_NUMBER",
+    "OP_DIVIDE_NUMBER",
+    "OP_GREATER_NUMBER",
+    "OP_GREATER_EQUAL_NUMBER",
+    "OP_LESS_NUMBER",
+    "OP_LESS_EQUAL_NUMBER",
+    "OP_WIDE",
+};
+static_assert(sizeof(opcode_names) / sizeof(opcode_names[0]) == OP_COUNT,
+              "opcode_names out of sync with OpCode");
+
+const char * opcode_name(uint8_t op)
+{
+    return op < OP_COUNT ? opcode_names[op] : "OP_UNKNOWN";
+}
 
 void Chunk::disassemble(const char * name)
 {
@@ -9,18 +79,15 @@ void Chunk::disassemble(const char * name)
     {
         offset = disassemble_instruction(offset);
     }
-
-    _lines.lindex = 0;
 }
 
-static int constant_instruction(const char * name, Chunk * chunk, int offset)
+static void print_constant(const char * name, Chunk * chunk, int constant)
 {
-    uint8_t constant = chunk->ccode()[offset + 1];
     printf("%-16s %4d '", name, constant);
     Value value = chunk->cconstants().vvalues()[constant];
     if (IS_CHAR(value))
     {
-        switch (value.as.character)
+        switch (AS_CHAR(value))
         {
             case '\n': printf("~n");     break;
             case '\t': printf("~t");     break;
@@ -32,10 +99,29 @@ static int constant_instruction(const char * name, Chunk * chunk, int offset)
         print_value(value);
     }
     printf("'\n");
+}
 
+static void print_global(const char * name, int slot)
+{
+    printf("%-16s %4d '", name, slot);
+    print_value(vm.global_names.vvalues()[slot]);
+    printf("'\n");
+}
+
+static int constant_instruction(const char * name, Chunk * chunk, int offset)
+{
+    print_constant(name, chunk, chunk->ccode()[offset + 1]);
     return offset + 2;
 }
 
+static int global_instruction(const char * name, Chunk * chunk, int offset)
+{
+    uint16_t slot = (uint16_t)(chunk->ccode()[offset + 1] << 8);
+    slot |= chunk->ccode()[offset + 2];
+    print_global(name, slot);
+    return offset + 3;
+}
+
 static int simple_instruction(const char * name, int offset)
 {
     printf("%s\n", name);
@@ -49,6 +135,16 @@ static int byte_instruction(const char * name, Chunk * chunk, int offset)
     return offset + 2;
 }
 
+static int increment_instruction(const char * name, Chunk * chunk, int offset)
+{
+    uint8_t slot = chunk->ccode()[offset + 1];
+    uint8_t constant = chunk->ccode()[offset + 2];
+    printf("%-16s %4d += ", name, slot);
+    print_value(chunk->cconstants().vvalues()[constant]);
+    printf("\n");
+    return offset + 3;
+}
+
 static int jump_instruction(const char * name, int sign, Chunk * chunk, int offset)
 {
     uint16_t jump = (uint16_t)(chunk->ccode()[offset + 1] << 8);
@@ -57,17 +153,68 @@ static int jump_instruction(const char * name, int sign, Chunk * chunk, int offs
     return offset + 3;
 }
 
+static int wide_instruction(Chunk * chunk, int offset)
+{
+    uint8_t * code = chunk->ccode();
+    int operand = (code[offset + 2] << 16) | (code[offset + 3] << 8) | code[offset + 4];
+
+    switch (code[offset + 1])
+    {
+        case OP_CONSTANT:
+            print_constant("OP_WIDE_CONSTANT", chunk, operand);
+            break;
+        case OP_GET_LOCAL:
+            printf("%-16s %4d\n", "OP_WIDE_GET_LOCAL", operand);
+            break;
+        case OP_SET_LOCAL:
+            printf("%-16s %4d\n", "OP_WIDE_SET_LOCAL", operand);
+            break;
+        case OP_GET_GLOBAL:
+            print_global("OP_WIDE_GET_GLOBAL", operand);
+            break;
+        case OP_SET_GLOBAL:
+            print_global("OP_WIDE_SET_GLOBAL", operand);
+            break;
+        case OP_DEFINE_GLOBAL:
+            print_global("OP_WIDE_DEFINE_GLOBAL", operand);
+            break;
+        case OP_JUMP:
+            printf("%-16s %4d -> %d\n", "OP_WIDE_JUMP", offset, offset + 5 + operand);
+            break;
+        case OP_JUMP_IF_TRUE:
+            printf("%-16s %4d -> %d\n", "OP_WIDE_JUMP_IF_TRUE", offset, offset + 5 + operand);
+            break;
+        case OP_JUMP_IF_FALSE:
+            printf("%-16s %4d -> %d\n", "OP_WIDE_JUMP_IF_FALSE", offset, offset + 5 + operand);
+            break;
+        case OP_LOOP:
+            printf("%-16s %4d -> %d\n", "OP_WIDE_LOOP", offset, offset + 5 - operand);
+            break;
+        default:
+            if (is_compare_jump(code[offset + 1]))
+            {
+                printf("OP_WIDE_%-8s %4d -> %d\n", opcode_name(code[offset + 1]) + 3, offset, offset + 5 + operand);
+                break;
+            }
+            printf("Unknown wide opcode %d\n", code[offset + 1]);
+            break;
+    }
+
+    return offset + 5;
+}
+
 int Chunk::disassemble_instruction(int offset)
 {
     printf("%04d ", offset);
 
-    if (offset > 0 && offset < _lines.lines[_lines.lindex - 1][1])
+    int line = get_line(offset);
+    if (offset > 0 && line == get_line(offset - 1))
     {
         printf("   | ");
     }
     else
     {
-        printf("%4d ", _lines.lines[_lines.lindex++][0]);
+        printf("%4d ", line);
     }
 
     uint8_t instruction = _code[offset];
@@ -85,15 +232,15 @@ int Chunk::disassemble_instruction(int offset)
             return simple_instruction("OP_POP", offset);
 
         case OP_GET_GLOBAL:
-            return constant_instruction("OP_GET_GLOBAL", this, offset);
+            return global_instruction("OP_GET_GLOBAL", this, offset);
         case OP_SET_GLOBAL:
-            return constant_instruction("OP_SET_GLOBAL", this, offset);
+            return global_instruction("OP_SET_GLOBAL", this, offset);
         case OP_GET_LOCAL:
             return byte_instruction("OP_GET_LOCAL", this, offset);
         case OP_SET_LOCAL:
             return byte_instruction("OP_SET_LOCAL", this, offset);
         case OP_DEFINE_GLOBAL:
-            return constant_instruction("OP_DEFINE_GLOBAL", this, offset);
+            return global_instruction("OP_DEFINE_GLOBAL", this, offset);
 
         case OP_EQUAL:
             return simple_instruction("OP_EQUAL", offset);
@@ -117,6 +264,16 @@ int Chunk::disassemble_instruction(int offset)
         case OP_DIVIDE:
             return simple_instruction("OP_DIVIDE", offset);
 
+        case OP_ADD_NUMBER:
+        case OP_SUBTRACT_NUMBER:
+        case OP_MULTIPLY_NUMBER:
+        case OP_DIVIDE_NUMBER:
+        case OP_GREATER_NUMBER:
+        case OP_GREATER_EQUAL_NUMBER:
+        case OP_LESS_NUMBER:
+        case OP_LESS_EQUAL_NUMBER:
+            return simple_instruction(opcode_name(instruction), offset);
+
         case OP_NOT:
             return simple_instruction("OP_NOT", offset);
 
@@ -125,6 +282,12 @@ int Chunk::disassemble_instruction(int offset)
 
         case OP_PRINT:
             return simple_instruction("OP_PRINT", offset);
+        case OP_READ_STRING:
+            return simple_instruction("OP_READ_STRING", offset);
+        case OP_READ_NUMBER:
+            return simple_instruction("OP_READ_NUMBER", offset);
+        case OP_READ_CHAR:
+            return simple_instruction("OP_READ_CHAR", offset);
 
         case OP_JUMP:
             return jump_instruction("OP_JUMP", 1, this, offset);
@@ -140,10 +303,31 @@ int Chunk::disassemble_instruction(int offset)
 
         case OP_CALL:
             return byte_instruction("OP_CALL", this, offset);
+        case OP_TAIL_CALL:
+            return byte_instruction("OP_TAIL_CALL", this, offset);
 
         case OP_OUT:
             return simple_instruction("OP_OUT", offset);
 
+        case OP_INCREMENT_LOCAL:
+            return increment_instruction("OP_INCREMENT_LOCAL", this, offset);
+        case OP_POPN:
+            return byte_instruction("OP_POPN", this, offset);
+
+        case OP_JUMP_IF_EQUAL:
+        case OP_JUMP_IF_NOT_EQUAL:
+        case OP_JUMP_IF_GREATER:
+        case OP_JUMP_IF_NOT_GREATER:
+        case OP_JUMP_IF_GREATER_EQUAL:
+        case OP_JUMP_IF_NOT_GREATER_EQUAL:
+        case OP_JUMP_IF_LESS:
+        case OP_JUMP_IF_NOT_LESS:
+        case OP_JUMP_IF_LESS_EQUAL:
+        case OP_JUMP_IF_NOT_LESS_EQUAL:
+            return jump_instruction(opcode_name(instruction), 1, this, offset);
+        case OP_WIDE:
+            return wide_instruction(this, offset);
+
         default:
             printf("Unknown opcode %d\n", instruction);
             return offset + 1;
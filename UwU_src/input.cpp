@@ -0,0 +1,137 @@
+#include <ctype.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <io.h>
+#define read _read
+#define STDIN_FILENO 0
+#else
+#include <unistd.h>
+#endif
+
+#include "input.h"
+#include "memory.h"
+
+// stdin is read in blocks into 'buffer'; 'cursor' is the next unread byte
+// and 'end' one past the last byte read. Lines that straddle a refill are
+// gathered into 'scratch', which only ever grows.
+static char buffer[INPUT_BUFFER_SIZE];
+static char * cursor = buffer;
+static char * end = buffer;
+
+static char * scratch = NULL;
+static int scratch_capacity = 0;
+
+// read() returns as soon as some input is available: a whole block from a
+// file or pipe, but a single line from a terminal, where waiting for a full
+// block (as fread() does) would hang until end of input.
+static bool fill_buffer()
+{
+    long bytes_read;
+    do bytes_read = read(STDIN_FILENO, buffer, INPUT_BUFFER_SIZE);
+    while (bytes_read < 0 && errno == EINTR);
+
+    cursor = buffer;
+    end = buffer + (bytes_read > 0 ? bytes_read : 0);
+    return bytes_read > 0;
+}
+
+static void reserve_scratch(int capacity)
+{
+    if (scratch_capacity >= capacity) return;
+
+    int old_capacity = scratch_capacity;
+    while (scratch_capacity < capacity) scratch_capacity = GROW_CAPACITY(scratch_capacity);
+    scratch = GROW_ARRAY(char, scratch, old_capacity, scratch_capacity);
+}
+
+int read_byte()
+{
+    if (cursor == end && !fill_buffer()) return EOF;
+    return (unsigned char)*cursor++;
+}
+
+// Reads up to the next newline, which is consumed but not included. Returns
+// NULL at the end of input; otherwise the characters stay valid until the
+// next read.
+const char * read_line(int * length)
+{
+    if (cursor == end && !fill_buffer()) return NULL;
+
+    char * newline = (char *)memchr(cursor, '\n', end - cursor);
+    if (newline)
+    {
+        const char * start = cursor;
+        *length = (int)(newline - cursor);
+        cursor = newline + 1;
+        return start;
+    }
+
+    int count = 0;
+    while (true)
+    {
+        int size = (int)((newline ? newline : end) - cursor);
+        reserve_scratch(count + size);
+        memcpy(scratch + count, cursor, size);
+        count += size;
+
+        if (newline)
+        {
+            cursor = newline + 1;
+            break;
+        }
+
+        if (!fill_buffer()) break;
+        newline = (char *)memchr(cursor, '\n', end - cursor);
+    }
+
+    *length = count;
+    return scratch;
+}
+
+static bool is_number_char(int c)
+{
+    return isdigit(c) || c == '.' || c == '-';
+}
+
+// Reads a number terminated by a newline or the end of input. Any other
+// character makes the result 0; that character is consumed and the rest of
+// the line is left for the next read.
+double read_number_line()
+{
+    char * current = cursor;
+    while (current < end && is_number_char(*current)) current++;
+
+    if (current < end)
+    {
+        // The whole token is buffered: parse it in place, strtod stops at
+        // the newline.
+        double number = 0;
+        if (*current == '\n' && current > cursor) number = strtod(cursor, NULL);
+        cursor = current + 1;
+        return number;
+    }
+
+    int count = 0;
+    while (true)
+    {
+        int c = read_byte();
+        if (c == EOF || c == '\n') break;
+        if (!is_number_char(c)) return 0;
+
+        reserve_scratch(count + 2);
+        scratch[count++] = (char)c;
+    }
+
+    if (count == 0) return 0;
+
+    scratch[count] = '\0';
+    return strtod(scratch, NULL);
+}
+
+void free_input()
+{
+    FREE_ARRAY(char, scratch, scratch_capacity);
+    scratch = NULL;
+    scratch_capacity = 0;
+}
@@ -0,0 +1,13 @@
+#ifndef INPUT_H_INCLUDED
+#define INPUT_H_INCLUDED
+
+#include "common.h"
+
+#define INPUT_BUFFER_SIZE (64 * 1024)
+
+const char * read_line(int *);
+double read_number_line();
+int read_byte();
+void free_input();
+
+#endif // INPUT_H_INCLUDED
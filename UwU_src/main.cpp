@@ -1,38 +1,74 @@
+#include <chrono>
+
 #include "common.h"
 #include "vm.h"
+#include "memory.h"
 #include "timer.h"
+#include "output.h"
+#include "input.h"
+#include "profile.h"
+#include "scanner.h"
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 extern int DEBUG_PRINT_CODE;
 extern int DEBUG_TRACE_EXECUTION;
+extern int PRINT_GC_STATS;
+extern int OPTIMIZE_CODE;
+extern int PROFILE_EXECUTION;
+extern int REGISTER_VM;
+extern int USE_CACHE;
+extern int LAZY_COMPILE;
 
 FILE * INPUT;
 
+// '-t': scan the script and report the token rate instead of running it.
+static int SCAN_ONLY = 0;
+
 static const char * EXTENSION = ".uwu";
 static int EXTENSION_LENGTH = 4;
 
 static void usage_error()
 {
-    fprintf(stderr, "usage: uwu <path> [-p | -e]\n");
+    fprintf(stderr, "usage: uwu <path | -> [-p | -e | -g | -n | -o | -r | -c | -l | -t]\n");
     exit(64);
 }
 
 static void repl()
 {
-    char line[1024];
+    // Each line's source is freed once it has run, so a function declared on
+    // it cannot be compiled later.
+    LAZY_COMPILE = 0;
+
     while (true)
     {
         printf("> ");
+        flush_output();
 
-        if (!fgets(line, sizeof(line), stdin))
+        // Lines come from the same buffered reader as iwi-s/-d/-c, so input
+        // typed ahead for a read is not lost.
+        int length = 0;
+        const char * input = read_line(&length);
+        if (input == NULL)
         {
             printf("\n");
             break;
         }
 
+        char * line = (char *)malloc(length + 2);
+        memcpy(line, input, length);
+        line[length] = '\n';
+        line[length + 1] = '\0';
+
         {
             //Timer timer;
             interpret(line);
         }
+        free(line);
 
         printf("\n");
         reset_frame();
@@ -49,8 +85,86 @@ static bool is_uwu_file(const char * path)
     return false;
 }
 
-static char * read_file(const char * path)
+// A script's text, always followed by a '\0' for the scanner. 'mapped' is
+// the length of the mapping when the file is mmapped, 0 when 'chars' is a
+// heap buffer.
+typedef struct
 {
+    char * chars;
+    size_t mapped;
+} Source;
+
+// Reads until end of file in INPUT_BUFFER_SIZE blocks, for input whose size
+// is not known up front (a pipe).
+static Source read_stream(FILE * stream, const char * name)
+{
+    size_t capacity = INPUT_BUFFER_SIZE;
+    size_t length = 0;
+    char * buffer = (char *)malloc(capacity + 1);
+
+    while (buffer != NULL)
+    {
+        if (capacity - length < INPUT_BUFFER_SIZE)
+        {
+            capacity *= 2;
+            char * grown = (char *)realloc(buffer, capacity + 1);
+            if (grown == NULL) free(buffer);
+            buffer = grown;
+            if (buffer == NULL) break;
+        }
+
+        size_t bytes_read = fread(buffer + length, sizeof(char), INPUT_BUFFER_SIZE, stream);
+        length += bytes_read;
+        if (bytes_read < INPUT_BUFFER_SIZE) break;
+    }
+
+    if (!buffer)
+    {
+        fprintf(stderr, "error: not enough memory to read file \"%s\".\n", name);
+        exit(68);
+    }
+
+    if (ferror(stream))
+    {
+        fprintf(stderr, "error: could not read file \"%s\".\n", name);
+        exit(69);
+    }
+
+    buffer[length] = '\0';
+
+    Source source = { buffer, 0 };
+    return source;
+}
+
+#ifndef _WIN32
+// Maps the file read-only so the scanner reads it in place. An anonymous
+// zero page range one page longer than the file is reserved first and the
+// file mapped over its start, so the byte after the last one is a '\0' even
+// when the file ends exactly on a page boundary.
+static bool map_file(int fd, size_t size, Source * source)
+{
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t length = (size / page + 1) * page;
+
+    void * reserved = mmap(NULL, length, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (reserved == MAP_FAILED) return false;
+
+    if (size > 0 && mmap(reserved, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        munmap(reserved, length);
+        return false;
+    }
+
+    source->chars = (char *)reserved;
+    source->mapped = length;
+    return true;
+}
+#endif
+
+static Source read_file(const char * path)
+{
+    if (strcmp(path, "-") == 0) return read_stream(stdin, "<stdin>");
+
     if (is_uwu_file(path))
     {
         INPUT = fopen(path, "rb");
@@ -67,30 +181,48 @@ static char * read_file(const char * path)
         exit(67);
     }
 
-    fseek(INPUT, 0L, SEEK_END);
-    size_t file_size = ftell(INPUT);
-    rewind(INPUT);
-
-    char * buffer = (char *)malloc(file_size + 1);
+    Source source;
 
-    if (!buffer)
+#ifndef _WIN32
+    // Regular files are mapped; anything else (a named pipe, say) is read
+    // as a stream.
+    struct stat info;
+    if (fstat(fileno(INPUT), &info) == 0 && S_ISREG(info.st_mode) &&
+        map_file(fileno(INPUT), (size_t)info.st_size, &source))
     {
-        fprintf(stderr, "error: not enough memory to read file \"%s\".\n", path);
-        exit(68);
+        fclose(INPUT);
+        return source;
     }
+#endif
 
-    size_t bytes_read = fread(buffer, sizeof(char), file_size, INPUT);
+    source = read_stream(INPUT, path);
+    fclose(INPUT);
+    return source;
+}
 
-    if (bytes_read < file_size)
+static void free_source(Source source)
+{
+#ifndef _WIN32
+    if (source.mapped > 0)
     {
-        fprintf(stderr, "error: could not read file \"%s\".\n", path);
-        exit(69);
+        munmap(source.chars, source.mapped);
+        return;
     }
+#endif
+    free(source.chars);
+}
+
+static void scan_only(const char * source)
+{
+    auto start = std::chrono::steady_clock::now();
 
-    buffer[bytes_read] = '\0';
+    long tokens = 0;
+    init_scanner(source);
+    while (scan_token().kind() != Kind::T_EOF) tokens++;
 
-    fclose(INPUT);
-    return buffer;
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    printf("scan: %ld tokens, %zu bytes in %.3fms (%.1fM tokens/s, %.1f MB/s)\n",
+           tokens, strlen(source), ms, tokens / ms / 1000, strlen(source) / ms / 1000);
 }
 
 static void read_flags(int argc, const char ** argv)
@@ -113,6 +245,50 @@ static void read_flags(int argc, const char ** argv)
                     else
                         usage_error();
                     break;
+                case 'g':
+                    if (!PRINT_GC_STATS)
+                        PRINT_GC_STATS = 1;
+                    else
+                        usage_error();
+                    break;
+                case 'n':
+                    if (OPTIMIZE_CODE)
+                        OPTIMIZE_CODE = 0;
+                    else
+                        usage_error();
+                    break;
+                case 'o':
+                    if (!PROFILE_EXECUTION)
+                        PROFILE_EXECUTION = 1;
+                    else
+                        usage_error();
+                    break;
+                case 'r':
+                    if (!REGISTER_VM)
+                        REGISTER_VM = 1;
+                    else
+                        usage_error();
+                    break;
+                case 'c':
+                    if (USE_CACHE)
+                        USE_CACHE = 0;
+                    else
+                        usage_error();
+                    break;
+                case 'l':
+                    if (LAZY_COMPILE)
+                        LAZY_COMPILE = 0;
+                    else
+                        usage_error();
+                    break;
+                case 't':
+                    if (!SCAN_ONLY)
+                        SCAN_ONLY = 1;
+                    else
+                        usage_error();
+                    break;
+                default:
+                    usage_error();
             }
         }
         else
@@ -129,17 +305,26 @@ static void run(int argc, const char ** argv)
         repl();
         return;
     }
-    else if (argc > 4)
-    {
-        fprintf(stderr, "usage: uwu <path> [-p | -e]\n");
-        exit(64);
-    }
 
     read_flags(argc, argv);
 
-	char * source = read_file(argv[1]);
-	InterpretResult result = interpret(source);
-	free(source);
+	// A script read from stdin has no file to keep a cache next to.
+	bool is_stdin = strcmp(argv[1], "-") == 0;
+	Source source = read_file(argv[1]);
+	if (SCAN_ONLY)
+	{
+		scan_only(source.chars);
+		free_source(source);
+		flush_output();
+		return;
+	}
+
+	InterpretResult result = interpret(source.chars, is_stdin ? NULL : argv[1]);
+	free_source(source);
+	flush_output();
+
+	if (PRINT_GC_STATS) print_gc_stats();
+	if (PROFILE_EXECUTION) print_profile();
 
 	if (result == INTERPRET_COMPILE_ERROR) exit(70);
 	if (result == INTERPRET_RUNTIME_ERROR) exit(71);
@@ -147,6 +332,7 @@ static void run(int argc, const char ** argv)
 
 int main(int argc, const char ** argv)
 {
+    init_output();
     initVM();
 
     run(argc, argv);
@@ -1,10 +1,27 @@
+#include <chrono>
+
 #include "memory.h"
+#include "compiler.h"
 #include "vm.h"
+#include "profile.h"
 
 extern VM vm;
 
-void * reallocate(void * pointer, size_t new_size)
+int PRINT_GC_STATS = 0;
+
+void * reallocate(void * pointer, size_t old_size, size_t new_size)
 {
+    vm.bytes_allocated += new_size - old_size;
+
+    if (new_size > old_size)
+    {
+#ifdef DEBUG_STRESS_GC
+        collect_garbage();
+#else
+        if (vm.bytes_allocated > vm.next_gc) collect_garbage();
+#endif
+    }
+
     if (new_size == 0)
     {
         free(pointer);
@@ -17,6 +34,162 @@ void * reallocate(void * pointer, size_t new_size)
     return result;
 }
 
+void mark_object(Object * object)
+{
+    if (object == NULL) return;
+    if (object->is_marked()) return;
+
+#ifdef DEBUG_LOG_GC
+    printf("%p mark ", (void *)object);
+    print_value(OBJECT_VAL(object));
+    printf("\n");
+#endif
+
+    object->is_marked() = true;
+
+    if (vm.gray_capacity < vm.gray_count + 1)
+    {
+        vm.gray_capacity = GROW_CAPACITY(vm.gray_capacity);
+        vm.gray_stack = (Object **)realloc(vm.gray_stack, sizeof(Object *) * vm.gray_capacity);
+
+        if (vm.gray_stack == NULL) exit(1);
+    }
+
+    vm.gray_stack[vm.gray_count++] = object;
+}
+
+void mark_value(Value value)
+{
+    if (IS_OBJECT(value)) mark_object(AS_OBJECT(value));
+}
+
+static void mark_array(ValueArray * array)
+{
+    for (int i = 0; i < array->vcount(); i++)
+    {
+        mark_value(array->vvalues()[i]);
+    }
+}
+
+static void blacken_object(Object * object)
+{
+#ifdef DEBUG_LOG_GC
+    printf("%p blacken ", (void *)object);
+    print_value(OBJECT_VAL(object));
+    printf("\n");
+#endif
+
+    switch (object->type())
+    {
+        case O_FUNCTION:
+        {
+            Function * _function = (Function *)object;
+            mark_object((Object *)_function->name());
+            mark_array(&_function->chunk().cconstants());
+            if (_function->registers() != NULL) mark_array(&_function->registers()->rconstants());
+            break;
+        }
+
+        case O_NATIVE:
+        case O_STRING:
+            break;
+    }
+}
+
+static void mark_roots()
+{
+    for (Value * slot = vm._stack; slot < vm.stack_top; slot++)
+    {
+        mark_value(*slot);
+    }
+
+    for (int i = 0; i < vm.frame_count; i++)
+    {
+        mark_object((Object *)vm.frames[i]._function);
+    }
+
+    vm.global_slots.mark();
+    mark_array(&vm.global_names);
+    mark_array(&vm.global_values);
+
+    mark_compiler_roots();
+    mark_profile_roots();
+}
+
+static void trace_references()
+{
+    while (vm.gray_count > 0)
+    {
+        Object * object = vm.gray_stack[--vm.gray_count];
+        blacken_object(object);
+    }
+}
+
+static void sweep()
+{
+    Object * previous = NULL;
+    Object * object = vm.objects;
+    while (object != NULL)
+    {
+        if (object->is_marked())
+        {
+            object->is_marked() = false;
+            previous = object;
+            object = object->next();
+        }
+        else
+        {
+            Object * unreached = object;
+            object = object->next();
+            if (previous != NULL)
+            {
+                previous->next() = object;
+            }
+            else
+            {
+                vm.objects = object;
+            }
+
+            unreached->free();
+        }
+    }
+}
+
+void collect_garbage()
+{
+#ifdef DEBUG_LOG_GC
+    printf("-- gc begin\n");
+    size_t before = vm.bytes_allocated;
+#endif
+
+    auto start = std::chrono::steady_clock::now();
+
+    mark_roots();
+    trace_references();
+    vm.strings.remove_white();
+    sweep();
+
+    vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
+    if (vm.next_gc < GC_MIN_HEAP) vm.next_gc = GC_MIN_HEAP;
+
+    double pause = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    vm.gc_count++;
+    vm.gc_total_pause += pause;
+    if (pause > vm.gc_max_pause) vm.gc_max_pause = pause;
+
+#ifdef DEBUG_LOG_GC
+    printf("-- gc end\n");
+    printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+           before - vm.bytes_allocated, before, vm.bytes_allocated, vm.next_gc);
+#endif
+}
+
+void print_gc_stats()
+{
+    fprintf(stderr, "gc: %d collections, %.3fms total pause, %.3fms max pause, %zu bytes live, next at %zu\n",
+            vm.gc_count, vm.gc_total_pause, vm.gc_max_pause, vm.bytes_allocated, vm.next_gc);
+}
+
 void free_objects()
 {
     Object * object = vm.objects;
@@ -26,4 +199,6 @@ void free_objects()
         object->free();
         object = next;
     }
+
+    free(vm.gray_stack);
 }
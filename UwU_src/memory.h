@@ -5,21 +5,28 @@
 #include "object.h"
 
 #define ALLOCATE(type, count) \
-    (type *)reallocate(NULL, sizeof(type) * (count))
+    (type *)reallocate(NULL, 0, sizeof(type) * (count))
 
 #define FREE(type, pointer) \
-    reallocate(pointer, 0)
+    reallocate(pointer, sizeof(type), 0)
 
 #define GROW_CAPACITY(capacity) \
     (capacity) < 8 ? 8 : 2 * (capacity)
 
-#define GROW_ARRAY(type, pointer, new_capacity) \
-    (type *)reallocate(pointer, sizeof(type) * (new_capacity))
+#define GROW_ARRAY(type, pointer, old_count, new_count) \
+    (type *)reallocate(pointer, sizeof(type) * (old_count), sizeof(type) * (new_count))
 
-#define FREE_ARRAY(type, pointer) \
-    reallocate(pointer, 0)
+#define FREE_ARRAY(type, pointer, old_count) \
+    reallocate(pointer, sizeof(type) * (old_count), 0)
 
-void * reallocate(void * pointer, size_t new_size);
+#define GC_HEAP_GROW_FACTOR 2
+#define GC_MIN_HEAP (1024 * 1024)
+
+void * reallocate(void * pointer, size_t old_size, size_t new_size);
+void mark_object(Object *);
+void mark_value(Value);
+void collect_garbage();
+void print_gc_stats();
 void free_objects();
 
 #endif // MEMORY_H_INCLUDED
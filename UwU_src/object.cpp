@@ -1,17 +1,24 @@
 #include "memory.h"
 #include "object.h"
+#include "table.h"
 #include "vm.h"
+#include "output.h"
 
 extern VM vm;
 
 Object * allocate_object(size_t _size, ObjType type)
 {
-    Object * object = (Object *)reallocate(NULL, _size);
+    Object * object = (Object *)reallocate(NULL, 0, _size);
     object->type() = type;
+    object->is_marked() = false;
 
     object->next() = vm.objects;
     vm.objects = object;
 
+#ifdef DEBUG_LOG_GC
+    printf("%p allocate %zu for %d\n", (void *)object, _size, type);
+#endif
+
     return object;
 }
 
@@ -26,8 +33,12 @@ Function * new_function()
 {
     Function * _function = ALLOCATE_OBJECT(Function, O_FUNCTION);
     _function->arity() = 0;
+    _function->max_stack() = 0;
     _function->name() = NULL;
     _function->chunk().init();
+    _function->registers() = NULL;
+    _function->source() = NULL;
+    _function->source_line() = 0;
     return _function;
 }
 
@@ -36,28 +47,36 @@ bool is_object_type(Value value, ObjType type)
     return IS_OBJECT(value) && AS_OBJECT(value)->type() == type;
 }
 
-String * allocate_string(char * chars, int length)
+String * allocate_string(char * chars, int length, uint32_t hash)
 {
     String * _string = ALLOCATE_OBJECT(String, O_STRING);
     _string->length() = length;
     _string->chars() = chars;
+    _string->hash() = hash;
 
-    vm.strings.insert(std::make_pair(_string, OBJECT_VAL(NULL)));
+    push(OBJECT_VAL(_string));
+    vm.strings.set(_string, NULL_VAL);
+    pop();
 
     return _string;
 }
 
 void String::free()
 {
-    FREE_ARRAY(char, _chars);
+    FREE_ARRAY(char, _chars, _length + 1);
 }
 
 void Object::free()
 {
+#ifdef DEBUG_LOG_GC
+    printf("%p free type %d\n", (void *)this, _type);
+#endif
+
     switch (_type)
     {
         case O_STRING:
         {
+            ((String *)this)->free();
             FREE(String, this);
             break;
         }
@@ -66,6 +85,11 @@ void Object::free()
         {
             Function * _function = (Function *)this;
             _function->chunk().free();
+            if (_function->registers() != NULL)
+            {
+                _function->registers()->free();
+                FREE(RegChunk, _function->registers());
+            }
             FREE(Function, this);
             break;
         }
@@ -78,39 +102,24 @@ void Object::free()
     }
 }
 
-String * find_key(std::unordered_map<String *, Value> * hash_table, const char * chars, int length)
-{
-    auto _iterator = hash_table->begin();
-
-    while (_iterator != hash_table->end())
-    {
-        if (_iterator->first->length() == length && memcmp(_iterator->first->chars(), chars, length) == 0)
-        {
-            return _iterator->first;
-        }
-
-        _iterator++;
-    }
-
-    return NULL;
-}
-
 String * take_string(char * chars, int length)
 {
-    String * interned = find_key(&vm.strings, chars, length);
+    uint32_t hash = hash_string(chars, length);
+    String * interned = vm.strings.find_string(chars, length, hash);
 
     if (interned != NULL)
     {
-        FREE_ARRAY(char, chars);
+        FREE_ARRAY(char, chars, length + 1);
         return interned;
     }
 
-    return allocate_string(chars, length);
+    return allocate_string(chars, length, hash);
 }
 
 String * copy_string(const char * chars, int length)
 {
-    String * interned = find_key(&vm.strings, chars, length);
+    uint32_t hash = hash_string(chars, length);
+    String * interned = vm.strings.find_string(chars, length, hash);
 
     if (interned != NULL) return interned;
 
@@ -118,7 +127,7 @@ String * copy_string(const char * chars, int length)
     memcpy(heap, chars, length);
     heap[length] = '\0';
 
-    return allocate_string(heap, length);
+    return allocate_string(heap, length, hash);
 }
 
 void print_function(Function * _function)
@@ -136,7 +145,7 @@ void print_object(Value value)
     switch (OBJECT_TYPE(value))
     {
         case O_STRING:
-            printf("%s", AS_CSTRING(value));
+            write_output(AS_CSTRING(value), AS_STRING(value)->length());
             break;
 
         case O_FUNCTION:
@@ -3,6 +3,7 @@
 
 #include "common.h"
 #include "chunk.h"
+#include "regcode.h"
 
 #define ALLOCATE_OBJECT(type, obj_type) \
     (type *)allocate_object(sizeof(type), obj_type)
@@ -29,11 +30,13 @@ class Object
 {
     private:
         ObjType _type;
+        bool _is_marked;
         Object * _next;
 
     public:
-        ObjType & type()  { return _type; }
-        Object * & next() { return _next; }
+        ObjType & type()    { return _type;      }
+        bool & is_marked()  { return _is_marked; }
+        Object * & next()   { return _next;      }
 
         void free();
 };
@@ -42,13 +45,24 @@ class Function : public Object
 {
     private:
         int _arity;
+        int _max_stack;
         Chunk _chunk;
+        RegChunk * _registers;
         String * _name;
 
+        // A function whose body has not been compiled yet keeps where its
+        // parameter list starts in the source, and on which line.
+        const char * _source;
+        int _source_line;
+
     public:
         int & arity()     { return _arity; }
+        int & max_stack() { return _max_stack; }
         Chunk & chunk()   { return _chunk; }
+        RegChunk * & registers() { return _registers; }
         String * & name() { return _name;  }
+        const char * & source() { return _source; }
+        int & source_line()     { return _source_line; }
 };
 
 typedef Value (* NativeFunction)(int, Value *);
@@ -69,10 +83,12 @@ class String : public Object
     private:
         int _length;
         char * _chars;
+        uint32_t _hash;
 
     public:
-        int & length()   { return _length; }
-        char * & chars() { return _chars;  }
+        int & length()     { return _length; }
+        char * & chars()   { return _chars;  }
+        uint32_t & hash()  { return _hash;   }
 
         void free();
 };
@@ -0,0 +1,357 @@
+#include "optimizer.h"
+#include "vm.h"
+
+// Peephole pass over a finished chunk. The chunk is decoded into an
+// instruction list (jumps point at instruction indices), rewritten, and
+// re-encoded, which recomputes jump distances and the line table.
+
+// targets[i] is the number of jumps landing on instruction i.
+static ArenaVector<int> find_targets(Code & code)
+{
+    ArenaVector<int> targets(code.size() + 1, 0);
+    for (Instruction & instruction : code)
+    {
+        if (is_jump(instruction.op)) targets[instruction.operand]++;
+    }
+    return targets;
+}
+
+// Drops the instructions marked in 'removed'. A jump to a removed
+// instruction lands on the next one that is kept.
+static void compact(Code & code, ArenaVector<bool> & removed)
+{
+    int n = (int)code.size();
+    ArenaVector<int> new_index(n + 1);
+
+    int kept = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (!removed[i]) kept++;
+    }
+
+    new_index[n] = kept;
+    for (int i = n - 1; i >= 0; i--)
+    {
+        new_index[i] = removed[i] ? new_index[i + 1] : --kept;
+    }
+
+    int next = 0;
+    for (int i = 0; i < n; i++)
+    {
+        if (removed[i]) continue;
+
+        Instruction instruction = code[i];
+        if (is_jump(instruction.op)) instruction.operand = new_index[instruction.operand];
+        code[next++] = instruction;
+    }
+
+    code.resize(next);
+}
+
+static bool any_target(ArenaVector<int> & targets, int from, int to)
+{
+    for (int i = from; i <= to; i++)
+    {
+        if (targets[i] > 0) return true;
+    }
+    return false;
+}
+
+static bool is_conditional_jump(uint8_t op)
+{
+    return op == OP_JUMP_IF_TRUE || op == OP_JUMP_IF_FALSE;
+}
+
+// Truthiness of the value an instruction pushes: 1 or 0 when it is a literal
+// or a constant, -1 otherwise.
+static int known_truth(Instruction & instruction, Chunk * chunk)
+{
+    switch (instruction.op)
+    {
+        case OP_TRUE:     return 1;
+        case OP_FALSE:    return 0;
+        case OP_NULL:     return 0;
+        case OP_CONSTANT: return !is_falsy(chunk->cconstants().vvalues()[instruction.operand]);
+
+        default: return -1;
+    }
+}
+
+// A conditional jump on a literal is decided here. When the jump is taken it
+// becomes a JUMP past the target's POP; when it is not, the literal, the
+// jump and the POP that follows disappear. ('?w? twue', 'untiw fawse',
+// 'twue awnd x'.)
+static bool fold_constant_branches(Code & code, Chunk * chunk)
+{
+    int n = (int)code.size();
+    ArenaVector<int> targets = find_targets(code);
+    ArenaVector<bool> removed(n, false);
+    bool changed = false;
+
+    for (int i = 0; i + 1 < n; i++)
+    {
+        uint8_t jump = code[i + 1].op;
+        int truth = known_truth(code[i], chunk);
+        if (!is_conditional_jump(jump) || truth == -1 || targets[i + 1] > 0) continue;
+
+        int target = code[i + 1].operand;
+        if ((jump == OP_JUMP_IF_TRUE) == (truth == 1))
+        {
+            code[i + 1].op = OP_JUMP;
+            if (target < n && code[target].op == OP_POP)
+            {
+                code[i + 1].operand = target + 1;
+                removed[i] = true;
+            }
+        }
+        else
+        {
+            removed[i + 1] = true;
+            if (i + 2 < n && code[i + 2].op == OP_POP && targets[i + 2] == 0)
+            {
+                removed[i] = removed[i + 2] = true;
+            }
+        }
+
+        changed = true;
+        i++;
+    }
+
+    compact(code, removed);
+    return changed;
+}
+
+// A jump landing on an unconditional jump goes straight to its target. A
+// conditional jump landing on another one (the condition is still on the
+// stack, as after 'awnd'/'ow') goes where that one would send it.
+static bool thread_jumps(Code & code)
+{
+    int n = (int)code.size();
+    bool changed = false;
+
+    for (int i = 0; i < n; i++)
+    {
+        if (!is_jump(code[i].op) || is_compare_jump(code[i].op)) continue;
+
+        // A chain longer than the code is a cycle of jumps (an empty
+        // infinite loop); it is left as it is.
+        int original = code[i].operand;
+        int steps = 0;
+        for (; steps < n; steps++)
+        {
+            int target = code[i].operand;
+            if (target >= n) break;
+
+            Instruction & next = code[target];
+            int thread;
+
+            if (next.op == OP_JUMP || next.op == OP_LOOP)
+            {
+                thread = next.operand;
+            }
+            else if (is_conditional_jump(code[i].op) && is_conditional_jump(next.op))
+            {
+                thread = next.op == code[i].op ? next.operand : target + 1;
+            }
+            else
+            {
+                break;
+            }
+
+            if (thread == target) break;
+            code[i].operand = thread;
+        }
+
+        if (steps == n) code[i].operand = original;
+        if (code[i].operand != original) changed = true;
+    }
+
+    return changed;
+}
+
+// Drops instructions no path reaches (code after 'out', the arm of a folded
+// branch) and jumps to the instruction right after them.
+static bool remove_dead_code(Code & code)
+{
+    int n = (int)code.size();
+    ArenaVector<bool> reached(n + 1, false);
+    ArenaVector<int> work;
+
+    reached[0] = true;
+    work.push_back(0);
+
+    while (!work.empty())
+    {
+        int i = work.back();
+        work.pop_back();
+        if (i >= n) continue;
+
+        uint8_t op = code[i].op;
+        bool falls_through = op != OP_JUMP && op != OP_LOOP && op != OP_OUT;
+
+        if (falls_through && !reached[i + 1])
+        {
+            reached[i + 1] = true;
+            work.push_back(i + 1);
+        }
+        if (is_jump(op) && !reached[code[i].operand])
+        {
+            reached[code[i].operand] = true;
+            work.push_back(code[i].operand);
+        }
+    }
+
+    ArenaVector<bool> removed(n, false);
+    bool changed = false;
+
+    for (int i = 0; i < n; i++)
+    {
+        removed[i] = !reached[i] || (is_jump(code[i].op) && !is_compare_jump(code[i].op) && code[i].operand == i + 1);
+        if (removed[i]) changed = true;
+    }
+
+    compact(code, removed);
+    return changed;
+}
+
+// Fused form of a comparison followed by a conditional jump.
+static uint8_t compare_jump(uint8_t compare, uint8_t jump)
+{
+    bool if_true = jump == OP_JUMP_IF_TRUE;
+
+    switch (compare)
+    {
+        case OP_EQUAL:         return if_true ? OP_JUMP_IF_EQUAL         : OP_JUMP_IF_NOT_EQUAL;
+        case OP_NOT_EQUAL:     return if_true ? OP_JUMP_IF_NOT_EQUAL     : OP_JUMP_IF_EQUAL;
+        case OP_GREATER:       return if_true ? OP_JUMP_IF_GREATER       : OP_JUMP_IF_NOT_GREATER;
+        case OP_GREATER_EQUAL: return if_true ? OP_JUMP_IF_GREATER_EQUAL : OP_JUMP_IF_NOT_GREATER_EQUAL;
+        case OP_LESS:          return if_true ? OP_JUMP_IF_LESS          : OP_JUMP_IF_NOT_LESS;
+        case OP_LESS_EQUAL:    return if_true ? OP_JUMP_IF_LESS_EQUAL    : OP_JUMP_IF_NOT_LESS_EQUAL;
+
+        default: return OP_COUNT;
+    }
+}
+
+// GET_LOCAL a, CONSTANT k, ADD, SET_LOCAL a, POP  =>  INCREMENT_LOCAL a k
+static void fuse_increments(Code & code)
+{
+    int n = (int)code.size();
+    ArenaVector<int> targets = find_targets(code);
+    ArenaVector<bool> removed(n, false);
+
+    for (int i = 0; i + 4 < n; i++)
+    {
+        if (code[i].op     != OP_GET_LOCAL ||
+            code[i + 1].op != OP_CONSTANT  ||
+            code[i + 2].op != OP_ADD       ||
+            code[i + 3].op != OP_SET_LOCAL ||
+            code[i + 4].op != OP_POP) continue;
+
+        int slot = code[i].operand;
+        int constant = code[i + 1].operand;
+        if (code[i + 3].operand != slot || slot > UINT8_MAX || constant > UINT8_MAX) continue;
+        if (any_target(targets, i + 1, i + 4)) continue;
+
+        code[i].op = OP_INCREMENT_LOCAL;
+        code[i].operand = (slot << 8) | constant;
+        for (int j = i + 1; j <= i + 4; j++) removed[j] = true;
+        i += 4;
+    }
+
+    compact(code, removed);
+}
+
+// A comparison feeding JUMP_IF_TRUE/FALSE, where both the fall-through path
+// and the jump target start by popping the condition, becomes one
+// instruction that pops the operands and jumps past the target's POP.
+static void fuse_compare_jumps(Code & code)
+{
+    int n = (int)code.size();
+    ArenaVector<int> targets = find_targets(code);
+    ArenaVector<bool> removed(n, false);
+
+    for (int i = 0; i + 2 < n; i++)
+    {
+        uint8_t jump = code[i + 1].op;
+        if (jump != OP_JUMP_IF_TRUE && jump != OP_JUMP_IF_FALSE) continue;
+
+        uint8_t fused = compare_jump(code[i].op, jump);
+        int target = code[i + 1].operand;
+
+        if (fused == OP_COUNT || code[i + 2].op != OP_POP) continue;
+        if (target <= i + 2 || target >= n || code[target].op != OP_POP) continue;
+        if (any_target(targets, i + 1, i + 2)) continue;
+
+        code[i].op = fused;
+        code[i].operand = target + 1;
+        removed[i + 1] = removed[i + 2] = true;
+        i += 2;
+    }
+
+    compact(code, removed);
+}
+
+// Runs of POP (such as the ones end_scope emits) become a single POPN.
+static void fuse_pops(Code & code)
+{
+    int n = (int)code.size();
+    ArenaVector<int> targets = find_targets(code);
+    ArenaVector<bool> removed(n, false);
+
+    for (int i = 0; i < n; i++)
+    {
+        if (code[i].op != OP_POP) continue;
+
+        int count = 1;
+        while (i + count < n && code[i + count].op == OP_POP &&
+               targets[i + count] == 0 && count < UINT8_MAX)
+        {
+            removed[i + count] = true;
+            count++;
+        }
+
+        if (count > 1)
+        {
+            code[i].op = OP_POPN;
+            code[i].operand = count;
+        }
+        i += count - 1;
+    }
+
+    compact(code, removed);
+}
+
+void optimize_chunk(Chunk * chunk, const LongJumps & long_jumps)
+{
+    Code code;
+    decode_chunk(chunk, code, &long_jumps);
+
+    // Passes only ever shrink 'code', so the scratch lists each one takes
+    // from the arena can be dropped after it without moving 'code'.
+    ArenaMark mark = arena_mark();
+
+    // Control-flow cleanup first, so the fusions below see straight-line
+    // code. Each pass can expose work for the others.
+    bool changed = true;
+    while (changed)
+    {
+        changed = fold_constant_branches(code, chunk);
+        arena_release(mark);
+        changed |= thread_jumps(code);
+        arena_release(mark);
+        changed |= remove_dead_code(code);
+        arena_release(mark);
+    }
+
+    fuse_increments(code);
+    arena_release(mark);
+    fuse_compare_jumps(code);
+    arena_release(mark);
+    // A fused compare-jump skips its target's POP, which may leave it dead.
+    remove_dead_code(code);
+    arena_release(mark);
+    fuse_pops(code);
+    arena_release(mark);
+
+    encode_chunk(code, chunk);
+}
@@ -0,0 +1,9 @@
+#ifndef OPTIMIZER_H_INCLUDED
+#define OPTIMIZER_H_INCLUDED
+
+#include "chunk.h"
+#include "assembler.h"
+
+void optimize_chunk(Chunk *, const LongJumps &);
+
+#endif // OPTIMIZER_H_INCLUDED
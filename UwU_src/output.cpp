@@ -0,0 +1,37 @@
+#include "output.h"
+
+#ifdef _WIN32
+#include <io.h>
+#define isatty _isatty
+#define fileno _fileno
+#else
+#include <unistd.h>
+#endif
+
+// Everything written to stdout (script output, disassembly, traces) goes
+// through this one buffer so it stays in order. It is flushed when full, on
+// every newline when stdout is a terminal, and explicitly with
+// flush_output() before input is read, before errors are reported and at
+// exit.
+static char buffer[OUTPUT_BUFFER_SIZE];
+
+void init_output()
+{
+    int mode = isatty(fileno(stdout)) ? _IOLBF : _IOFBF;
+    setvbuf(stdout, buffer, mode, OUTPUT_BUFFER_SIZE);
+}
+
+void write_output(const char * chars, size_t length)
+{
+    fwrite(chars, sizeof(char), length, stdout);
+}
+
+void write_char(char c)
+{
+    putchar(c);
+}
+
+void flush_output()
+{
+    fflush(stdout);
+}
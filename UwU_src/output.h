@@ -0,0 +1,13 @@
+#ifndef OUTPUT_H_INCLUDED
+#define OUTPUT_H_INCLUDED
+
+#include "common.h"
+
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+void init_output();
+void write_output(const char *, size_t);
+void write_char(char);
+void flush_output();
+
+#endif // OUTPUT_H_INCLUDED
@@ -0,0 +1,146 @@
+#include <algorithm>
+#include <unordered_map>
+#include <vector>
+
+#include "profile.h"
+#include "chunk.h"
+#include "memory.h"
+
+int PROFILE_EXECUTION = 0;
+
+#define PROFILE_TOP 20
+
+// Filled in by the profiling instantiation of the interpreter loop ('-o').
+// Per-line counts are kept per byte offset while running and only mapped to
+// lines when the report is printed.
+static uint64_t opcode_counts[OP_COUNT];
+static uint64_t pair_counts[OP_COUNT][OP_COUNT];
+static int previous_opcode = -1;
+static bool profile_registers = false;
+static_assert((int)R_COUNT <= (int)OP_COUNT, "register opcodes must fit the profile counters");
+
+static std::unordered_map<Function *, std::vector<uint64_t>> offset_counts;
+static Function * last_function = NULL;
+static std::vector<uint64_t> * last_counts = NULL;
+
+static void count_instruction(Function * _function, uint8_t opcode, int offset, int size)
+{
+    opcode_counts[opcode]++;
+    if (previous_opcode != -1) pair_counts[previous_opcode][opcode]++;
+    previous_opcode = opcode;
+
+    if (_function != last_function)
+    {
+        last_function = _function;
+        last_counts = &offset_counts[_function];
+    }
+
+    if ((int)last_counts->size() < size) last_counts->resize(size, 0);
+    (*last_counts)[offset]++;
+}
+
+void profile_instruction(Function * _function, uint8_t * ip)
+{
+    Chunk & chunk = _function->chunk();
+    count_instruction(_function, *ip, (int)(ip - chunk.ccode()), chunk.ccount());
+}
+
+// Under '-r' the counts are of register instructions, indexed by position.
+void profile_register_instruction(Function * _function, RegInstruction * pc)
+{
+    RegChunk * registers = _function->registers();
+    profile_registers = true;
+    count_instruction(_function, pc->op, (int)(pc - registers->rcode()), registers->rcount());
+}
+
+// Functions seen by the profiler stay alive until the report is printed.
+void mark_profile_roots()
+{
+    for (auto & entry : offset_counts)
+    {
+        mark_object((Object *)entry.first);
+    }
+}
+
+static const char * profile_opcode_name(int op)
+{
+    return profile_registers ? reg_opcode_name(op) : opcode_name(op);
+}
+
+static int profile_line(Function * _function, int offset)
+{
+    return profile_registers ? _function->registers()->get_line(offset) : _function->chunk().get_line(offset);
+}
+
+static void print_entry(const char * name, uint64_t count, uint64_t total)
+{
+    fprintf(stderr, "  %-44s %12llu %6.2f%%\n", name, (unsigned long long)count, 100.0 * count / total);
+}
+
+void print_profile()
+{
+    uint64_t total = 0;
+    for (int i = 0; i < OP_COUNT; i++) total += opcode_counts[i];
+    if (total == 0) return;
+
+    fprintf(stderr, "profile: %llu instructions executed\n", (unsigned long long)total);
+
+    std::vector<std::pair<uint64_t, std::string>> rows;
+    char name[128];
+
+    for (int i = 0; i < OP_COUNT; i++)
+    {
+        if (opcode_counts[i] > 0) rows.push_back({opcode_counts[i], profile_opcode_name(i)});
+    }
+    std::sort(rows.rbegin(), rows.rend());
+
+    fprintf(stderr, "opcodes:\n");
+    for (auto & row : rows) print_entry(row.second.c_str(), row.first, total);
+
+    rows.clear();
+    for (int i = 0; i < OP_COUNT; i++)
+    {
+        for (int j = 0; j < OP_COUNT; j++)
+        {
+            if (pair_counts[i][j] == 0) continue;
+            snprintf(name, sizeof(name), "%s -> %s", profile_opcode_name(i), profile_opcode_name(j));
+            rows.push_back({pair_counts[i][j], name});
+        }
+    }
+    std::sort(rows.rbegin(), rows.rend());
+    if (rows.size() > PROFILE_TOP) rows.resize(PROFILE_TOP);
+
+    fprintf(stderr, "opcode pairs (top %d):\n", PROFILE_TOP);
+    for (auto & row : rows) print_entry(row.second.c_str(), row.first, total);
+
+    rows.clear();
+    for (auto & entry : offset_counts)
+    {
+        Function * _function = entry.first;
+        std::unordered_map<int, uint64_t> line_counts;
+        for (int offset = 0; offset < (int)entry.second.size(); offset++)
+        {
+            if (entry.second[offset] > 0) line_counts[profile_line(_function, offset)] += entry.second[offset];
+        }
+
+        for (auto & line : line_counts)
+        {
+            const char * function_name = _function->name() != NULL ? _function->name()->chars() : "script";
+            snprintf(name, sizeof(name), "<%s> line %d", function_name, line.first);
+            rows.push_back({line.second, name});
+        }
+    }
+    std::sort(rows.rbegin(), rows.rend());
+    if (rows.size() > PROFILE_TOP) rows.resize(PROFILE_TOP);
+
+    fprintf(stderr, "lines (top %d):\n", PROFILE_TOP);
+    for (auto & row : rows) print_entry(row.second.c_str(), row.first, total);
+}
+
+void free_profile()
+{
+    offset_counts.clear();
+    last_function = NULL;
+    last_counts = NULL;
+    profile_registers = false;
+}
@@ -0,0 +1,13 @@
+#ifndef PROFILE_H_INCLUDED
+#define PROFILE_H_INCLUDED
+
+#include "common.h"
+#include "object.h"
+
+void profile_instruction(Function *, uint8_t *);
+void profile_register_instruction(Function *, RegInstruction *);
+void mark_profile_roots();
+void print_profile();
+void free_profile();
+
+#endif // PROFILE_H_INCLUDED
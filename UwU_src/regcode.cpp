@@ -0,0 +1,591 @@
+#include "regcode.h"
+#include "assembler.h"
+#include "memory.h"
+#include "object.h"
+#include "vm.h"
+
+extern VM vm;
+extern int DEBUG_PRINT_CODE;
+
+static const char * reg_opcode_names[] =
+{
+    "R_MOVE",
+    "R_GET_GLOBAL",
+    "R_SET_GLOBAL",
+    "R_DEFINE_GLOBAL",
+    "R_EQUAL",
+    "R_NOT_EQUAL",
+    "R_GREATER",
+    "R_GREATER_EQUAL",
+    "R_LESS",
+    "R_LESS_EQUAL",
+    "R_ADD",
+    "R_SUBTRACT",
+    "R_MULTIPLY",
+    "R_DIVIDE",
+    "R_NOT",
+    "R_NEGATE",
+    "R_PRINT",
+    "R_READ_STRING",
+    "R_READ_NUMBER",
+    "R_READ_CHAR",
+    "R_JUMP",
+    "R_JUMP_IF_TRUE",
+    "R_JUMP_IF_FALSE",
+    "R_JUMP_IF_EQUAL",
+    "R_JUMP_IF_NOT_EQUAL",
+    "R_JUMP_IF_GREATER",
+    "R_JUMP_IF_NOT_GREATER",
+    "R_JUMP_IF_GREATER_EQUAL",
+    "R_JUMP_IF_NOT_GREATER_EQUAL",
+    "R_JUMP_IF_LESS",
+    "R_JUMP_IF_NOT_LESS",
+    "R_JUMP_IF_LESS_EQUAL",
+    "R_JUMP_IF_NOT_LESS_EQUAL",
+    "R_CALL",
+    "R_TAIL_CALL",
+    "R_OUT",
+};
+static_assert(sizeof(reg_opcode_names) / sizeof(reg_opcode_names[0]) == R_COUNT,
+              "reg_opcode_names out of sync with RegOpCode");
+
+const char * reg_opcode_name(uint8_t op)
+{
+    return op < R_COUNT ? reg_opcode_names[op] : "R_UNKNOWN";
+}
+
+void RegChunk::init()
+{
+    _count = _capacity = 0;
+    _code = NULL;
+    _lines.lcount = _lines.lcapacity = 0;
+    _lines.runs = NULL;
+    _constants.init();
+    _frame_size = 0;
+}
+
+int RegChunk::write(RegInstruction instruction, int line)
+{
+    if (_capacity < _count + 1)
+    {
+        int old_capacity = _capacity;
+
+        _capacity = GROW_CAPACITY(old_capacity);
+        _code = GROW_ARRAY(RegInstruction, _code, old_capacity, _capacity);
+    }
+
+    add_line_run(_lines, _count, line);
+
+    _code[_count] = instruction;
+    return _count++;
+}
+
+void RegChunk::free()
+{
+    FREE_ARRAY(RegInstruction, _code, _capacity);
+    FREE_ARRAY(LineRun, _lines.runs, _lines.lcapacity);
+    _constants.free();
+    init();
+}
+
+int RegChunk::get_line(int index)
+{
+    return find_line(_lines, index);
+}
+
+static void print_operand(RegChunk * chunk, int operand)
+{
+    if (operand & REG_CONSTANT)
+    {
+        printf(" k%d'", operand & REG_MAX);
+        print_value(chunk->rconstants().vvalues()[operand & REG_MAX]);
+        printf("'");
+    }
+    else
+    {
+        printf(" r%d", operand);
+    }
+}
+
+static void print_global(int slot)
+{
+    printf(" g%d'", slot);
+    print_value(vm.global_names.vvalues()[slot]);
+    printf("'");
+}
+
+void RegChunk::disassemble(const char * name)
+{
+    printf("===== %s (registers: %d) =====\n", name, _frame_size);
+
+    for (int index = 0; index < _count;)
+    {
+        index = disassemble_instruction(index);
+    }
+}
+
+int RegChunk::disassemble_instruction(int index)
+{
+    printf("%04d ", index);
+
+    int line = get_line(index);
+    if (index > 0 && line == get_line(index - 1))
+    {
+        printf("   | ");
+    }
+    else
+    {
+        printf("%4d ", line);
+    }
+
+    RegInstruction & instruction = _code[index];
+    printf("%-28s", reg_opcode_name(instruction.op));
+
+    switch (instruction.op)
+    {
+        case R_MOVE:
+        case R_NOT:
+        case R_NEGATE:
+            printf(" r%d", instruction.a);
+            print_operand(this, instruction.b);
+            break;
+
+        case R_GET_GLOBAL:
+            printf(" r%d", instruction.a);
+            print_global(instruction.b);
+            break;
+
+        case R_SET_GLOBAL:
+        case R_DEFINE_GLOBAL:
+            print_global(instruction.a);
+            print_operand(this, instruction.b);
+            break;
+
+        case R_PRINT:
+        case R_OUT:
+            print_operand(this, instruction.b);
+            break;
+
+        case R_READ_STRING:
+        case R_READ_NUMBER:
+        case R_READ_CHAR:
+            printf(" r%d", instruction.a);
+            break;
+
+        case R_JUMP:
+            printf(" -> %d", index + 1 + (int16_t)instruction.a);
+            break;
+
+        case R_JUMP_IF_TRUE:
+        case R_JUMP_IF_FALSE:
+            print_operand(this, instruction.b);
+            printf(" -> %d", index + 1 + (int16_t)instruction.a);
+            break;
+
+        case R_CALL:
+        case R_TAIL_CALL:
+            printf(" r%d (%d)", instruction.a, instruction.b);
+            break;
+
+        default:
+            if (instruction.op >= R_JUMP_IF_EQUAL && instruction.op <= R_JUMP_IF_NOT_LESS_EQUAL)
+            {
+                print_operand(this, instruction.b);
+                print_operand(this, instruction.c);
+                printf(" -> %d", index + 1 + (int16_t)instruction.a);
+            }
+            else
+            {
+                printf(" r%d", instruction.a);
+                print_operand(this, instruction.b);
+                print_operand(this, instruction.c);
+            }
+            break;
+    }
+
+    printf("\n");
+    return index + 1;
+}
+
+// Stack to register translation.
+//
+// The stack slot at depth d becomes register d, so locals keep their slots.
+// While translating a basic block the value stack is tracked symbolically:
+// each entry is the operand that holds its value (a constant, the register of
+// a local it was read from, or its own register), and a value is only copied
+// into its own register when something needs it there: a call, a jump, or a
+// write to the register it was read from. Pushing a local or a constant
+// therefore costs nothing, and a result that is stored straight into a local
+// is computed into that local.
+//
+// Invariant: an entry refers to register r only while entry r itself is in
+// register r, so copying an entry into its own register never clobbers a
+// value that another entry still reads.
+class RegisterTranslator
+{
+    private:
+        Function * _function;
+        RegChunk * chunk;
+        Code code;
+        ArenaVector<int> stack;
+        ArenaVector<int> label;
+        ArenaVector<int> patches;
+        int last_result;
+        int true_constant;
+        int false_constant;
+        int null_constant;
+        bool failed;
+        int line;
+
+        int emit(uint8_t op, int a, int b, int c)
+        {
+            if (a > UINT16_MAX || b > UINT16_MAX || c > UINT16_MAX || chunk->rcount() >= UINT16_MAX)
+            {
+                failed = true;
+                return -1;
+            }
+
+            RegInstruction instruction;
+            instruction.op = op;
+            instruction.a = (uint16_t)a;
+            instruction.b = (uint16_t)b;
+            instruction.c = (uint16_t)c;
+            last_result = -1;
+            return chunk->write(instruction, line);
+        }
+
+        int constant_operand(int index)
+        {
+            if (index > REG_MAX) failed = true;
+            return REG_CONSTANT | (index & REG_MAX);
+        }
+
+        int literal(int & index, Value value)
+        {
+            if (index == -1)
+            {
+                chunk->rconstants().write(value);
+                index = chunk->rconstants().vcount() - 1;
+            }
+            return constant_operand(index);
+        }
+
+        void push(int operand)
+        {
+            if ((int)stack.size() >= REG_MAX) failed = true;
+            stack.push_back(operand);
+            if ((int)stack.size() > chunk->frame_size()) chunk->frame_size() = (int)stack.size();
+        }
+
+        int pop()
+        {
+            int operand = stack.back();
+            stack.pop_back();
+            last_result = -1;
+            return operand;
+        }
+
+        void materialize(int slot)
+        {
+            if (stack[slot] == slot) return;
+            emit(R_MOVE, slot, stack[slot], 0);
+            stack[slot] = slot;
+        }
+
+        void flush(int from)
+        {
+            for (int slot = from; slot < (int)stack.size(); slot++) materialize(slot);
+        }
+
+        // Computes into the register of the new top entry.
+        void push_result(uint8_t op, int b, int c)
+        {
+            int destination = (int)stack.size();
+            int index = emit(op, destination, b, c);
+            push(destination);
+            last_result = index;
+        }
+
+        // The top entry is stored into local 'slot' and stays on the stack.
+        void set_local(int slot)
+        {
+            int value = stack.back();
+            if (value == slot) return;
+
+            bool shared = false;
+            for (int i = 0; i < (int)stack.size(); i++)
+            {
+                if (i != slot && stack[i] == slot) shared = true;
+            }
+
+            int top = (int)stack.size() - 1;
+            if (!shared && last_result != -1 && last_result == chunk->rcount() - 1 && value == top)
+            {
+                chunk->rcode()[last_result].a = (uint16_t)slot;
+                stack[top] = slot;
+            }
+            else
+            {
+                for (int i = 0; i < (int)stack.size(); i++)
+                {
+                    if (i != slot && stack[i] == slot) materialize(i);
+                }
+                emit(R_MOVE, slot, value, 0);
+            }
+
+            stack[slot] = slot;
+        }
+
+        void jump(uint8_t op, int target, int b, int c)
+        {
+            int index = emit(op, 0, b, c);
+            if (index != -1)
+            {
+                patches.push_back(index);
+                patches.push_back(target);
+            }
+        }
+
+        bool pops_first(int index)
+        {
+            return index < (int)code.size() && (code[index].op == OP_POP || code[index].op == OP_POPN);
+        }
+
+        void translate(Instruction &, int);
+
+    public:
+        RegisterTranslator(Function * _function) :
+            _function(_function), chunk(NULL), last_result(-1),
+            true_constant(-1), false_constant(-1), null_constant(-1), failed(false), line(0) {}
+
+        bool run();
+};
+
+void RegisterTranslator::translate(Instruction & instruction, int next)
+{
+    switch (instruction.op)
+    {
+        case OP_CONSTANT: push(constant_operand(instruction.operand)); break;
+        case OP_TRUE:     push(literal(true_constant, BOOL_VAL(true)));   break;
+        case OP_FALSE:    push(literal(false_constant, BOOL_VAL(false))); break;
+        case OP_NULL:     push(literal(null_constant, NULL_VAL));         break;
+
+        case OP_POP:  pop(); break;
+        case OP_POPN: stack.resize(stack.size() - instruction.operand); last_result = -1; break;
+
+        case OP_GET_LOCAL:
+            if (instruction.operand >= (int)stack.size()) failed = true;
+            else push(stack[instruction.operand]);
+            break;
+
+        case OP_SET_LOCAL:
+            if (instruction.operand >= (int)stack.size()) failed = true;
+            else set_local(instruction.operand);
+            break;
+
+        // slot += constant, as GET_LOCAL, CONSTANT, ADD, SET_LOCAL, POP.
+        case OP_INCREMENT_LOCAL:
+        {
+            int slot = instruction.operand >> 8;
+            if (slot >= (int)stack.size())
+            {
+                failed = true;
+                break;
+            }
+            push_result(R_ADD, stack[slot], constant_operand(instruction.operand & 0xff));
+            set_local(slot);
+            pop();
+            break;
+        }
+
+        case OP_GET_GLOBAL:    push_result(R_GET_GLOBAL, instruction.operand, 0); break;
+        case OP_SET_GLOBAL:    emit(R_SET_GLOBAL, instruction.operand, stack.back(), 0); break;
+        case OP_DEFINE_GLOBAL: emit(R_DEFINE_GLOBAL, instruction.operand, pop(), 0); break;
+
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_GREATER:
+        case OP_GREATER_EQUAL:
+        case OP_LESS:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        {
+            int c = pop();
+            int b = pop();
+            push_result(R_EQUAL + (instruction.op - OP_EQUAL), b, c);
+            break;
+        }
+
+        case OP_NOT:    push_result(R_NOT, pop(), 0);    break;
+        case OP_NEGATE: push_result(R_NEGATE, pop(), 0); break;
+
+        case OP_PRINT: emit(R_PRINT, 0, pop(), 0); break;
+
+        case OP_READ_STRING: push_result(R_READ_STRING, 0, 0); break;
+        case OP_READ_NUMBER: push_result(R_READ_NUMBER, 0, 0); break;
+        case OP_READ_CHAR:   push_result(R_READ_CHAR, 0, 0);   break;
+
+        case OP_JUMP:
+        case OP_LOOP:
+            flush(0);
+            jump(R_JUMP, instruction.operand, 0, 0);
+            break;
+
+        // The condition stays on the stack. When both paths start by popping
+        // it, it is tested where it is instead of being copied into place.
+        case OP_JUMP_IF_TRUE:
+        case OP_JUMP_IF_FALSE:
+        {
+            uint8_t op = instruction.op == OP_JUMP_IF_TRUE ? R_JUMP_IF_TRUE : R_JUMP_IF_FALSE;
+            if (pops_first(next) && pops_first(instruction.operand))
+            {
+                int condition = pop();
+                flush(0);
+                stack.push_back(condition);
+            }
+            else
+            {
+                flush(0);
+            }
+            jump(op, instruction.operand, stack.back(), 0);
+            break;
+        }
+
+        // The callee's frame starts at the callee: it and the arguments must be
+        // in their registers, anything below is left alone.
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        {
+            int base = (int)stack.size() - instruction.operand - 1;
+            flush(base);
+            emit(instruction.op == OP_CALL ? R_CALL : R_TAIL_CALL, base, instruction.operand, 0);
+            stack.resize(base + 1);
+            stack[base] = base;
+            break;
+        }
+
+        case OP_OUT: emit(R_OUT, 0, pop(), 0); break;
+
+        default:
+            if (is_compare_jump(instruction.op))
+            {
+                int c = pop();
+                int b = pop();
+                flush(0);
+                jump(R_JUMP_IF_EQUAL + (instruction.op - OP_JUMP_IF_EQUAL), instruction.operand, b, c);
+                break;
+            }
+            failed = true;
+            break;
+    }
+}
+
+bool RegisterTranslator::run()
+{
+    decode_chunk(&_function->chunk(), code);
+    int n = (int)code.size();
+    ArenaVector<int> depth = stack_depths(code, _function->arity() + 1);
+    if (depth[n] != -1) return false;
+
+    ArenaVector<bool> targets(n + 1, false);
+    for (Instruction & instruction : code)
+    {
+        if (is_jump(instruction.op)) targets[instruction.operand] = true;
+    }
+
+    chunk = ALLOCATE(RegChunk, 1);
+    chunk->init();
+    _function->registers() = chunk;
+
+    ValueArray & constants = _function->chunk().cconstants();
+    for (int i = 0; i < constants.vcount(); i++) chunk->rconstants().write(constants.vvalues()[i]);
+
+    label.assign(n, -1);
+    bool reachable = false;
+
+    for (int i = 0; i < n && !failed; i++)
+    {
+        if (depth[i] == -1)
+        {
+            reachable = false;
+            continue;
+        }
+
+        line = code[i].line;
+        if (targets[i] || !reachable)
+        {
+            if (reachable) flush(0);
+            stack.resize(depth[i]);
+            for (int slot = 0; slot < depth[i]; slot++) stack[slot] = slot;
+            if (depth[i] > chunk->frame_size()) chunk->frame_size() = depth[i];
+            last_result = -1;
+        }
+        label[i] = chunk->rcount();
+        reachable = true;
+
+        if ((int)stack.size() != depth[i])
+        {
+            failed = true;
+            break;
+        }
+
+        translate(code[i], i + 1);
+
+        uint8_t op = code[i].op;
+        if (op == OP_JUMP || op == OP_LOOP || op == OP_OUT) reachable = false;
+    }
+
+    if (failed) return false;
+
+    // Jump operands are distances from the next instruction.
+    for (size_t i = 0; i < patches.size(); i += 2)
+    {
+        int distance = label[patches[i + 1]] - (patches[i] + 1);
+        if (distance < INT16_MIN || distance > INT16_MAX) return false;
+        chunk->rcode()[patches[i]].a = (uint16_t)(int16_t)distance;
+    }
+
+    return true;
+}
+
+bool compile_registers(Function * _function)
+{
+    if (_function->registers() != NULL) return true;
+
+    ValueArray & constants = _function->chunk().cconstants();
+    for (int i = 0; i < constants.vcount(); i++)
+    {
+        Value constant = constants.vvalues()[i];
+        if (IS_FUNCTION(constant) && !compile_registers(AS_FUNCTION(constant))) return false;
+    }
+
+    // The translator's lists go back to the arena as soon as it is done.
+    ArenaMark mark = arena_mark();
+    bool translated;
+    {
+        RegisterTranslator translator(_function);
+        translated = translator.run();
+    }
+    arena_release(mark);
+
+    if (!translated)
+    {
+        if (_function->registers() != NULL)
+        {
+            _function->registers()->free();
+            FREE(RegChunk, _function->registers());
+            _function->registers() = NULL;
+        }
+        return false;
+    }
+
+    if (DEBUG_PRINT_CODE)
+    {
+        _function->registers()->disassemble(_function->name() != NULL ? _function->name()->chars() : "<script>");
+    }
+
+    return true;
+}
@@ -0,0 +1,107 @@
+#ifndef REGCODE_H_INCLUDED
+#define REGCODE_H_INCLUDED
+
+#include "common.h"
+#include "chunk.h"
+
+class Function;
+
+// Register instruction set run by '-r'. Registers are the slots of the call
+// frame: locals keep their stack slot and temporaries live above them.
+// Instructions are three-address: 'a' is the destination register (or, for
+// jumps, the signed distance in instructions from the next instruction), 'b'
+// and 'c' are operands. An operand with REG_CONSTANT set names a constant
+// instead of a register.
+typedef enum
+{
+    R_MOVE,             // a = b
+    R_GET_GLOBAL,       // a = global b
+    R_SET_GLOBAL,       // global a = b
+    R_DEFINE_GLOBAL,    // global a = b, defining it
+
+    R_EQUAL,            // a = b op c
+    R_NOT_EQUAL,
+    R_GREATER,
+    R_GREATER_EQUAL,
+    R_LESS,
+    R_LESS_EQUAL,
+
+    R_ADD,
+    R_SUBTRACT,
+    R_MULTIPLY,
+    R_DIVIDE,
+
+    R_NOT,              // a = op b
+    R_NEGATE,
+
+    R_PRINT,            // print b
+    R_READ_STRING,      // a = input
+    R_READ_NUMBER,
+    R_READ_CHAR,
+
+    R_JUMP,             // jump to a
+    R_JUMP_IF_TRUE,     // jump to a if b is truthy
+    R_JUMP_IF_FALSE,
+
+    R_JUMP_IF_EQUAL,    // jump to a if b op c
+    R_JUMP_IF_NOT_EQUAL,
+    R_JUMP_IF_GREATER,
+    R_JUMP_IF_NOT_GREATER,
+    R_JUMP_IF_GREATER_EQUAL,
+    R_JUMP_IF_NOT_GREATER_EQUAL,
+    R_JUMP_IF_LESS,
+    R_JUMP_IF_NOT_LESS,
+    R_JUMP_IF_LESS_EQUAL,
+    R_JUMP_IF_NOT_LESS_EQUAL,
+
+    R_CALL,             // a = a(a + 1, ..., a + b)
+    R_TAIL_CALL,        // the same, reusing the frame when a is a function
+    R_OUT,              // return b
+
+    R_COUNT,
+} RegOpCode;
+
+#define REG_CONSTANT 0x8000
+#define REG_MAX (REG_CONSTANT - 1)
+
+typedef struct
+{
+    uint8_t op;
+    uint16_t a;
+    uint16_t b;
+    uint16_t c;
+} RegInstruction;
+
+const char * reg_opcode_name(uint8_t);
+
+class RegChunk
+{
+    private:
+        int _count;
+        int _capacity;
+        RegInstruction * _code;
+        Lines _lines;
+        ValueArray _constants;
+        int _frame_size;
+
+    public:
+        int rcount()                { return _count;      }
+        RegInstruction * rcode()    { return _code;       }
+        ValueArray & rconstants()   { return _constants;  }
+        int & frame_size()          { return _frame_size; }
+
+        void init();
+        int write(RegInstruction, int);
+        void free();
+        int get_line(int);
+
+        void disassemble(const char *);
+        int disassemble_instruction(int);
+};
+
+// Translates the function's stack code, and that of every function among its
+// constants, to register code. Returns false if some function has an
+// instruction or operand the register set cannot express.
+bool compile_registers(Function *);
+
+#endif // REGCODE_H_INCLUDED
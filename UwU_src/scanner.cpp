@@ -1,6 +1,18 @@
 #include "common.h"
 #include "scanner.h"
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// The block scans below read whole aligned 16-byte blocks, which may run
+// past the '\0' that ends the source (never past the page it is on).
+#if defined(__GNUC__)
+#define NO_SANITIZE_ADDRESS __attribute__((no_sanitize_address))
+#else
+#define NO_SANITIZE_ADDRESS
+#endif
+
 typedef struct
 {
     const char * start;
@@ -10,10 +22,86 @@ typedef struct
 
 Scanner scanner;
 
-void init_scanner(const char * source)
+// Character classes, indexed by the unsigned byte.
+#define C_SPACE  0x01 // ' ', '\t', '\r'
+#define C_DIGIT  0x02
+#define C_ALPHA  0x04 // letters, '.', '^' and '?': anything that starts an identifier
+#define C_IDENTIFIER (C_DIGIT | C_ALPHA)
+
+static uint8_t char_class[256];
+
+// Keywords live in a table indexed by a hash of their length and first and
+// last bytes, chosen so that no two keywords share a slot: a lookup is one
+// hash and at most one memcmp.
+typedef struct
+{
+    const char * name;
+    int length;
+    Kind kind;
+} Keyword;
+
+#define KEYWORD_SLOTS 32
+
+static Keyword keywords[KEYWORD_SLOTS];
+
+static int keyword_slot(const char * start, int length)
+{
+    return ((uint8_t)start[0] * 2 + (uint8_t)start[length - 1] * 3 + length) & (KEYWORD_SLOTS - 1);
+}
+
+static void init_tables()
+{
+    static bool initialized = false;
+    if (initialized) return;
+    initialized = true;
+
+    for (int c = 0; c < 256; c++)
+    {
+        if (c == ' ' || c == '\t' || c == '\r') char_class[c] |= C_SPACE;
+        if (c >= '0' && c <= '9') char_class[c] |= C_DIGIT;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '.' || c == '^' || c == '?')
+        {
+            char_class[c] |= C_ALPHA;
+        }
+    }
+
+    static const Keyword list[] =
+    {
+        { "awnd",  4, Kind::T_AND   },
+        { "ow",    2, Kind::T_OR    },
+        { "fwun",  4, Kind::T_FUN   },
+        { "uwu",   3, Kind::T_VAR   },
+        { "ouo",   3, Kind::T_PRINT },
+        { "iwi",   3, Kind::T_READ  },
+        { "?w?",   3, Kind::T_IF    },
+        { "ewe",   3, Kind::T_ELSE  },
+        { "untiw", 5, Kind::T_LOOP  },
+        { "twue",  4, Kind::T_TRUE  },
+        { "fawse", 5, Kind::T_FALSE },
+        { "out",   3, Kind::T_OUT   },
+    };
+
+    for (const Keyword & keyword : list)
+    {
+        Keyword & slot = keywords[keyword_slot(keyword.name, keyword.length)];
+
+        // A new keyword that lands on a taken slot needs new factors in
+        // keyword_slot(), or it would silently replace the other one.
+        if (slot.name != NULL)
+        {
+            fprintf(stderr, "keywowds '%s' and '%s' shawe a swot.\n", slot.name, keyword.name);
+            exit(1);
+        }
+        slot = keyword;
+    }
+}
+
+void init_scanner(const char * source, int line)
 {
+    init_tables();
+
     scanner.start = scanner.current = source;
-    scanner.line = 1;
+    scanner.line = line;
 }
 
 bool is_at_end()
@@ -32,12 +120,6 @@ static char peek()
     return *scanner.current;
 }
 
-static char peek_next()
-{
-    if (is_at_end()) return '\0';
-    return scanner.current[1];
-}
-
 static bool match(char expected)
 {
     if (is_at_end()) return false;
@@ -61,124 +143,167 @@ static Token error_token(const char * message)
     return token;
 }
 
-static void skip_whitespace()
+#if defined(__SSE2__)
+// Bit i is set when byte i of the aligned block holding 'p' is at or after
+// 'p' and is one of 'a', 'b' or '\0'.
+NO_SANITIZE_ADDRESS
+static unsigned first_block(const char * p, __m128i a, __m128i b)
+{
+    uintptr_t offset = (uintptr_t)p & 15;
+    __m128i block = _mm_load_si128((const __m128i *)(p - offset));
+    __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, a), _mm_cmpeq_epi8(block, b)),
+                                _mm_cmpeq_epi8(block, _mm_setzero_si128()));
+    return (unsigned)_mm_movemask_epi8(hits) & (0xffffu << offset);
+}
+#endif
+
+// The first byte at or after 'p' that is 'a', 'b' or the terminating '\0'.
+NO_SANITIZE_ADDRESS
+static const char * find_any(const char * p, char a, char b)
+{
+#if defined(__SSE2__)
+    __m128i va = _mm_set1_epi8(a);
+    __m128i vb = _mm_set1_epi8(b);
+
+    unsigned mask = first_block(p, va, vb);
+    p = (const char *)((uintptr_t)p & ~(uintptr_t)15);
+
+    while (mask == 0)
+    {
+        p += 16;
+        __m128i block = _mm_load_si128((const __m128i *)p);
+        __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, va), _mm_cmpeq_epi8(block, vb)),
+                                    _mm_cmpeq_epi8(block, _mm_setzero_si128()));
+        mask = (unsigned)_mm_movemask_epi8(hits);
+    }
+
+    return p + __builtin_ctz(mask);
+#else
+    while (*p != a && *p != b && *p != '\0') p++;
+    return p;
+#endif
+}
+
+// The first byte at or after 'p' that is not a space, tab or carriage return.
+NO_SANITIZE_ADDRESS
+static const char * skip_spaces(const char * p)
+{
+#if defined(__SSE2__)
+    // Most runs are a single space or one line's indentation, so the first
+    // bytes are checked one at a time before going block-wise.
+    for (int i = 0; i < 4; i++, p++)
+    {
+        if (!(char_class[(uint8_t)*p] & C_SPACE)) return p;
+    }
+
+    uintptr_t offset = (uintptr_t)p & 15;
+    p -= offset;
+    unsigned skip = (1u << offset) - 1;
+
+    while (true)
+    {
+        __m128i block = _mm_load_si128((const __m128i *)p);
+        __m128i spaces = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, _mm_set1_epi8(' ')),
+                                                   _mm_cmpeq_epi8(block, _mm_set1_epi8('\t'))),
+                                      _mm_cmpeq_epi8(block, _mm_set1_epi8('\r')));
+        unsigned others = ~((unsigned)_mm_movemask_epi8(spaces) | skip) & 0xffff;
+        if (others != 0) return p + __builtin_ctz(others);
+
+        p += 16;
+        skip = 0;
+    }
+#else
+    while (char_class[(uint8_t)*p] & C_SPACE) p++;
+    return p;
+#endif
+}
+
+// A newline counts towards the line number unless it ends the source.
+static void count_newline(const char * newline)
 {
+    if (newline[1] != '\0') scanner.line++;
+}
+
+// Skips a '{: ... :}' comment starting at the current position. The ':'
+// of '{:' may also start the closing ':}', so '{:}' is a whole comment. An
+// unterminated comment runs to the end of the source.
+static void skip_comment()
+{
+    const char * p = scanner.current + 1;
+
     while (true)
     {
-        char c = peek();
-        switch (c)
+        p = find_any(p, ':', '\n');
+
+        if (*p == '\0') break;
+        if (*p++ == '\n')
         {
-            case ' ': case '\r': case '\t': advance(); break;
+            count_newline(p - 1);
+            continue;
+        }
+        if (*p == '}')
+        {
+            p++;
+            break;
+        }
+    }
+
+    scanner.current = p;
+}
+
+static void skip_whitespace()
+{
+    while (true)
+    {
+        scanner.current = skip_spaces(scanner.current);
 
+        switch (peek())
+        {
             case '\n':
+                count_newline(scanner.current);
                 advance();
-                if (!is_at_end()) scanner.line++;
                 break;
 
             case '{':
-            {
-                if (peek_next() == ':')
-                {
-                    while (!is_at_end())
-                    {
-                        if (match(':') && match('}')) break;
-                        advance();
-                    }
-                }
-                else
-                {
-                    return;
-                }
+                if (scanner.current[1] != ':') return;
+                skip_comment();
                 break;
-            }
 
             default: return;
         }
     }
 }
 
-static Kind check_keyword(int start, int length, const char * rest, Kind kind, bool can_be_id)
-{
-    if (scanner.current - scanner.start == start + length &&
-        memcmp(scanner.start + start, rest, length) == 0)
-    {
-        return kind;
-    }
-
-    if (can_be_id) return Kind::T_IDENTIFIER;
-    return Kind::T_ERROR;
-}
-
 static Kind identifier_kind()
 {
-    switch (scanner.start[0])
-    {
-        case 'a': return check_keyword(1, 3, "wnd",   Kind::T_AND,   true);
-        case 'i': return check_keyword(1, 2, "wi",    Kind::T_READ,  true);
-        case '?': return check_keyword(1, 2, "w?",    Kind::T_IF,    false);
-        case 'e': return check_keyword(1, 2, "we",    Kind::T_ELSE,  true);
-        case 't': return check_keyword(1, 3, "wue",   Kind::T_TRUE,  true);
-
-        case 'f':
-            if (scanner.start[1])
-            {
-                switch (scanner.start[1])
-                {
-                    case 'a': return check_keyword(2, 3, "wse",  Kind::T_FALSE, true);
-                    case 'w': return check_keyword(2, 2, "un",   Kind::T_FUN,   true);
-                }
-            }
+    int length = (int)(scanner.current - scanner.start);
+    Keyword & keyword = keywords[keyword_slot(scanner.start, length)];
 
-        case 'u':
-            if (scanner.start[1])
-            {
-                switch (scanner.start[1])
-                {
-                    case 'w': return check_keyword(2, 1, "u", Kind::T_VAR, true);
-                    case 'n': return check_keyword(2, 3, "tiw", Kind::T_LOOP, true);
-                }
-            }
-            break;
-
-        case 'o':
-            if (scanner.start[1])
-            {
-                switch (scanner.start[1])
-                {
-                    case 'w': return Kind::T_OR;
-                    case 'u':
-                        if (scanner.start[2])
-                        {
-                            switch (scanner.start[2])
-                            {
-                                case 'o': return Kind::T_PRINT;
-                                case 't': return Kind::T_OUT;
-                            }
-                        }
-                }
-            }
-            break;
+    if (keyword.length == length && memcmp(keyword.name, scanner.start, length) == 0)
+    {
+        return keyword.kind;
     }
 
+    // '?w?' is the only word that may start with a '?'.
+    if (scanner.start[0] == '?') return Kind::T_ERROR;
     return Kind::T_IDENTIFIER;
 }
 
 static Token _identifier()
 {
-    while(isalnum(peek()) || peek() == '?' || peek() == '.' || peek() == '^')
-        advance();
+    while (char_class[(uint8_t)peek()] & C_IDENTIFIER) advance();
 
     return make_token(identifier_kind());
 }
 
 static Token _number()
 {
-    while (isdigit(peek())) advance();
+    while (char_class[(uint8_t)peek()] & C_DIGIT) advance();
 
-    if (peek() == '.' && isdigit(peek_next()))
+    if (peek() == '.' && (char_class[(uint8_t)scanner.current[1]] & C_DIGIT))
     {
         advance();
-        while (isdigit(peek())) advance();
+        while (char_class[(uint8_t)peek()] & C_DIGIT) advance();
     }
 
     return make_token(Kind::T_NUMBER);
@@ -186,9 +311,12 @@ static Token _number()
 
 static Token _string()
 {
-    while (peek() != '"' && !is_at_end())
+    while (true)
     {
-        if (peek() == '\n' && peek_next() != '\0') scanner.line++;
+        scanner.current = find_any(scanner.current, '"', '\n');
+        if (peek() != '\n') break;
+
+        count_newline(scanner.current);
         advance();
     }
 
@@ -229,9 +357,10 @@ Token scan_token()
 
     char c = advance();
 
-    if (isalpha(c) || c == '.' || c == '^' || c == '?')
+    uint8_t type = char_class[(uint8_t)c];
+    if (type & C_ALPHA)
         return _identifier();
-    if (isdigit(c))
+    if (type & C_DIGIT)
         return _number();
 
     switch (c)
@@ -50,7 +50,8 @@ class Token {
 
 typedef Token::Kind Kind;
 
-void init_scanner(const char *);
+// Scanning can start partway into a source, at the given line.
+void init_scanner(const char *, int line = 1);
 Token scan_token();
 
 #endif // SCANNER_H_INCLUDED
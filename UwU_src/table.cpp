@@ -0,0 +1,167 @@
+#include "table.h"
+#include "object.h"
+#include "memory.h"
+
+uint32_t hash_string(const char * key, int length)
+{
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < length; i++)
+    {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619;
+    }
+
+    return hash;
+}
+
+void Table::init()
+{
+    _count = _capacity = 0;
+    _entries = NULL;
+}
+
+void Table::free()
+{
+    FREE_ARRAY(Entry, _entries, _capacity);
+    init();
+}
+
+// Entries with a NULL key and a non-null value are tombstones: they keep probe
+// sequences intact after a removal and are reused by the next insertion.
+static Entry * find_entry(Entry * entries, int capacity, String * key)
+{
+    uint32_t index = key->hash() & (capacity - 1);
+    Entry * tombstone = NULL;
+
+    while (true)
+    {
+        Entry * entry = &entries[index];
+        if (entry->key == NULL)
+        {
+            if (IS_NULL(entry->value))
+            {
+                return tombstone != NULL ? tombstone : entry;
+            }
+            else if (tombstone == NULL)
+            {
+                tombstone = entry;
+            }
+        }
+        else if (entry->key == key)
+        {
+            return entry;
+        }
+
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+void Table::adjust_capacity(int capacity)
+{
+    Entry * entries = ALLOCATE(Entry, capacity);
+    for (int i = 0; i < capacity; i++)
+    {
+        entries[i].key = NULL;
+        entries[i].value = NULL_VAL;
+    }
+
+    _count = 0;
+    for (int i = 0; i < _capacity; i++)
+    {
+        Entry * entry = &_entries[i];
+        if (entry->key == NULL) continue;
+
+        Entry * destination = find_entry(entries, capacity, entry->key);
+        destination->key = entry->key;
+        destination->value = entry->value;
+        _count++;
+    }
+
+    FREE_ARRAY(Entry, _entries, _capacity);
+    _entries = entries;
+    _capacity = capacity;
+}
+
+bool Table::get(String * key, Value * value)
+{
+    if (_count == 0) return false;
+
+    Entry * entry = find_entry(_entries, _capacity, key);
+    if (entry->key == NULL) return false;
+
+    *value = entry->value;
+    return true;
+}
+
+bool Table::set(String * key, Value value)
+{
+    if (_count + 1 > _capacity * TABLE_MAX_LOAD)
+    {
+        adjust_capacity(GROW_CAPACITY(_capacity));
+    }
+
+    Entry * entry = find_entry(_entries, _capacity, key);
+    bool is_new_key = entry->key == NULL;
+    if (is_new_key && IS_NULL(entry->value)) _count++;
+
+    entry->key = key;
+    entry->value = value;
+    return is_new_key;
+}
+
+bool Table::remove(String * key)
+{
+    if (_count == 0) return false;
+
+    Entry * entry = find_entry(_entries, _capacity, key);
+    if (entry->key == NULL) return false;
+
+    entry->key = NULL;
+    entry->value = BOOL_VAL(true);
+    return true;
+}
+
+void Table::mark()
+{
+    for (int i = 0; i < _capacity; i++)
+    {
+        Entry * entry = &_entries[i];
+        mark_object((Object *)entry->key);
+        mark_value(entry->value);
+    }
+}
+
+void Table::remove_white()
+{
+    for (int i = 0; i < _capacity; i++)
+    {
+        Entry * entry = &_entries[i];
+        if (entry->key != NULL && !entry->key->is_marked())
+        {
+            remove(entry->key);
+        }
+    }
+}
+
+String * Table::find_string(const char * chars, int length, uint32_t hash)
+{
+    if (_count == 0) return NULL;
+
+    uint32_t index = hash & (_capacity - 1);
+    while (true)
+    {
+        Entry * entry = &_entries[index];
+        if (entry->key == NULL)
+        {
+            if (IS_NULL(entry->value)) return NULL;
+        }
+        else if (entry->key->length() == length &&
+                 entry->key->hash() == hash &&
+                 memcmp(entry->key->chars(), chars, length) == 0)
+        {
+            return entry->key;
+        }
+
+        index = (index + 1) & (_capacity - 1);
+    }
+}
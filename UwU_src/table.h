@@ -0,0 +1,43 @@
+#ifndef TABLE_H_INCLUDED
+#define TABLE_H_INCLUDED
+
+#include "common.h"
+#include "value.h"
+
+#define TABLE_MAX_LOAD 0.75
+
+typedef struct
+{
+    String * key;
+    Value value;
+} Entry;
+
+class Table
+{
+    private:
+        int _count;
+        int _capacity;
+        Entry * _entries;
+
+        void adjust_capacity(int);
+
+    public:
+        int tcount()         { return _count;    }
+        int tcapacity()      { return _capacity; }
+        Entry * tentries()   { return _entries;  }
+
+        Table() : _count(0), _capacity(0), _entries(NULL) {}
+
+        void init();
+        void free();
+        bool get(String *, Value *);
+        bool set(String *, Value);
+        bool remove(String *);
+        void mark();
+        void remove_white();
+        String * find_string(const char *, int, uint32_t);
+};
+
+uint32_t hash_string(const char *, int);
+
+#endif // TABLE_H_INCLUDED
@@ -1,6 +1,7 @@
 #include "value.h"
 #include "object.h"
 #include "memory.h"
+#include "output.h"
 
 void ValueArray::write(Value value)
 {
@@ -9,7 +10,7 @@ void ValueArray::write(Value value)
         int old_capacity = _capacity;
 
         _capacity = GROW_CAPACITY(old_capacity);
-        _values = GROW_ARRAY(Value, _values, _capacity);
+        _values = GROW_ARRAY(Value, _values, old_capacity, _capacity);
     }
 
     _values[_count] = value;
@@ -23,12 +24,20 @@ void ValueArray::init()
 
 void ValueArray::free()
 {
-    FREE_ARRAY(Value, _values);
+    FREE_ARRAY(Value, _values, _capacity);
     init();
 }
 
 bool values_equal(Value a, Value b)
 {
+#ifdef NAN_BOXING
+    if (IS_NUMBER(a) && IS_NUMBER(b))
+    {
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+
+    return !IS_NULL(a) && a == b;
+#else
     if (a.type != b.type) return false;
 
     switch (a.type)
@@ -40,27 +49,26 @@ bool values_equal(Value a, Value b)
 
         default: return false;
     }
+#endif
 }
 
 void print_value(Value value)
 {
-    switch (value.type)
+    if (IS_BOOL(value))
     {
-        case V_BOOL:
-            printf(AS_BOOL(value) ? "twue" : "fawse");
-            break;
-        case V_NUMBER:
-            printf("%.15g", AS_NUMBER(value));
-            break;
-        case V_CHAR:
-            printf("%c", AS_CHAR(value));
-            break;
-        case V_OBJECT:
-            print_object(value);
-            break;
-
-        default: return;
+        if (AS_BOOL(value)) write_output("twue", 4);
+        else write_output("fawse", 5);
+    }
+    else if (IS_NUMBER(value))
+    {
+        printf("%.15g", AS_NUMBER(value));
+    }
+    else if (IS_CHAR(value))
+    {
+        write_char(AS_CHAR(value));
+    }
+    else if (IS_OBJECT(value))
+    {
+        print_object(value);
     }
-
-    fflush(stdout);
 }
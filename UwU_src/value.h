@@ -6,6 +6,64 @@
 class Object;
 class String;
 
+#ifdef NAN_BOXING
+
+// Numbers are stored as plain doubles. Every other value lives inside the
+// quiet NaN space: objects set the sign bit and keep their pointer in the low
+// 48 bits, while null, the booleans and characters use small tags in the low
+// bits (a character keeps its byte just above the tag). UNDEFINED_VAL marks a
+// global slot the compiler has resolved but the program has not defined yet;
+// it never reaches UwU code.
+#define SIGN_BIT  ((uint64_t)0x8000000000000000)
+#define QNAN      ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NULL  1
+#define TAG_FALSE 2
+#define TAG_TRUE  3
+#define TAG_CHAR  4
+#define TAG_UNDEFINED 5
+
+typedef uint64_t Value;
+
+#define FALSE_VAL          ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL           ((Value)(uint64_t)(QNAN | TAG_TRUE))
+
+#define IS_BOOL(value)     (((value) | 1) == TRUE_VAL)
+#define IS_NUMBER(value)   (((value) & QNAN) != QNAN)
+#define IS_CHAR(value)     (((value) & (SIGN_BIT | QNAN | 0xff)) == (QNAN | TAG_CHAR))
+#define IS_OBJECT(value)   (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+#define IS_NULL(value)     ((value) == NULL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+
+#define AS_BOOL(value)     ((value) == TRUE_VAL)
+#define AS_NUMBER(value)   value_to_number(value)
+#define AS_CHAR(value)     ((char)(((value) >> 8) & 0xff))
+#define AS_OBJECT(value)   ((Object *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(value)    ((value) ? TRUE_VAL : FALSE_VAL)
+#define NUMBER_VAL(value)  number_to_value(value)
+#define CHAR_VAL(value)    ((Value)(QNAN | ((uint64_t)(uint8_t)(value) << 8) | TAG_CHAR))
+#define OBJECT_VAL(value)  ((Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(value)))
+
+#define NULL_VAL           ((Value)(uint64_t)(QNAN | TAG_NULL))
+#define UNDEFINED_VAL      ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+
+static inline double value_to_number(Value value)
+{
+    double number;
+    memcpy(&number, &value, sizeof(Value));
+    return number;
+}
+
+static inline Value number_to_value(double number)
+{
+    Value value;
+    memcpy(&value, &number, sizeof(double));
+    return value;
+}
+
+#else
+
 typedef enum
 {
     V_BOOL,
@@ -13,6 +71,7 @@ typedef enum
     V_CHAR,
     V_OBJECT,
     V_NULL,
+    V_UNDEFINED,
 } ValueType;
 
 typedef struct
@@ -30,6 +89,8 @@ typedef struct
 #define IS_NUMBER(value)   ((value).type == V_NUMBER)
 #define IS_CHAR(value)     ((value).type == V_CHAR)
 #define IS_OBJECT(value)   ((value).type == V_OBJECT)
+#define IS_NULL(value)     ((value).type == V_NULL)
+#define IS_UNDEFINED(value) ((value).type == V_UNDEFINED)
 
 #define AS_BOOL(value)     ((value).as.boolean)
 #define AS_NUMBER(value)   ((value).as.number)
@@ -42,6 +103,9 @@ typedef struct
 #define OBJECT_VAL(value)  ((Value){V_OBJECT, {.object    = (Object *)value}})
 
 #define NULL_VAL           ((Value){V_NULL,   {.number    = 0}})
+#define UNDEFINED_VAL      ((Value){V_UNDEFINED, {.number = 0}})
+
+#endif // NAN_BOXING
 
 class ValueArray
 {
@@ -3,19 +3,48 @@
 #include "vm.h"
 #include "compiler.h"
 #include "memory.h"
+#include "output.h"
+#include "input.h"
+#include "profile.h"
+#include "cache.h"
+#include "arena.h"
 
 extern int DEBUG_TRACE_EXECUTION;
+extern int DEBUG_PRINT_CODE;
+extern int OPTIMIZE_CODE;
+extern int USE_CACHE;
+extern int PROFILE_EXECUTION;
+extern int LAZY_COMPILE;
+
+int REGISTER_VM = 0;
+
+// Frames printed at each end of a runtime error's stack trace.
+#define TRACE_FRAMES 16
 
 VM vm;
 
-void define_native(const char * name, NativeFunction _function, int arity)
+int global_slot(String * name)
 {
-    Native * native = new_native(_function);
-    native->arity() = arity;
+    Value slot;
+    if (vm.global_slots.get(name, &slot)) return (int)AS_NUMBER(slot);
+
+    push(OBJECT_VAL(name));
+    int index = vm.global_values.vcount();
+    vm.global_values.write(UNDEFINED_VAL);
+    vm.global_names.write(OBJECT_VAL(name));
+    vm.global_slots.set(name, NUMBER_VAL((double)index));
+    pop();
 
+    return index;
+}
+
+void define_native(const char * name, NativeFunction _function, int arity)
+{
     push(OBJECT_VAL(copy_string(name, (int)strlen(name))));
-    push(OBJECT_VAL(native));
-    vm.globals.insert(std::make_pair(AS_STRING(vm._stack[0]), vm._stack[1]));
+    push(OBJECT_VAL(new_native(_function)));
+    AS_NATIVE(vm._stack[1])->arity() = arity;
+    int slot = global_slot(AS_STRING(vm._stack[0]));
+    vm.global_values.vvalues()[slot] = vm._stack[1];
     pop();
     pop();
 }
@@ -33,6 +62,7 @@ void reset_stack()
 
 void runtime__error(const char * format, ...)
 {
+    flush_output();
     fprintf(stderr, "ewwow: ");
 
     va_list args;
@@ -43,21 +73,26 @@ void runtime__error(const char * format, ...)
 
     for (int i = vm.frame_count - 1; i >= 0; i--)
     {
+        // Deep recursion would print a line per frame: keep both ends.
+        if (i == vm.frame_count - 1 - TRACE_FRAMES && i >= TRACE_FRAMES)
+        {
+            fprintf(stderr, "[... %d mowe fwames ...]\n", i + 1 - TRACE_FRAMES);
+            i = TRACE_FRAMES - 1;
+        }
+
         CallFrame * frame = &vm.frames[i];
         Function * _function = frame->_function;
-        Chunk chunk = _function->chunk();
-
-        int current_line;
-        int ip_index = (int)(frame->ip - chunk.ccode());
-        for (int i = 0; i <= chunk.clines().lcount; i++)
+        // ip (pc) already points past the failing instruction.
+        int line;
+        if (vm.register_mode)
         {
-            if (ip_index < chunk.clines().lines[i][1])
-            {
-                current_line = i;
-                break;
-            }
+            line = _function->registers()->get_line((int)(frame->pc - _function->registers()->rcode()) - 1);
         }
-        fprintf(stderr, "[line %d] in ", chunk.clines().lines[current_line][0]);
+        else
+        {
+            line = _function->chunk().get_line((int)(frame->ip - _function->chunk().ccode()) - 1);
+        }
+        fprintf(stderr, "[line %d] in ", line);
 
         if (!(_function->name())) fprintf(stderr, "scwipt\n");
         else fprintf(stderr, "<%s>\n", _function->name()->chars());
@@ -66,11 +101,96 @@ void runtime__error(const char * format, ...)
     reset_stack();
 }
 
+// Moves the stack to a larger block that holds 'needed' values plus
+// STACK_HEADROOM. Every frame and vm.stack_top are fixed up; callers must
+// reload any other pointer into the stack they hold. Returns false past
+// STACK_MAX.
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+static bool grow_stack(size_t needed)
+{
+    needed += STACK_HEADROOM;
+    if (needed > STACK_MAX) return false;
+
+    size_t capacity = vm.stack_capacity;
+    while (capacity < needed) capacity *= 2;
+    if (capacity > STACK_MAX) capacity = STACK_MAX;
+
+    Value * stack = (Value *)malloc(sizeof(Value) * capacity);
+    if (stack == NULL) exit(1);
+    memcpy(stack, vm._stack, sizeof(Value) * vm.stack_capacity);
+
+    for (int i = 0; i < vm.frame_count; i++)
+    {
+        CallFrame * frame = &vm.frames[i];
+        frame->slots = stack + (frame->slots - vm._stack);
+        if (vm.register_mode) frame->top = stack + (frame->top - vm._stack);
+    }
+    vm.stack_top = stack + (vm.stack_top - vm._stack);
+
+    free(vm._stack);
+    vm._stack = stack;
+    vm.stack_capacity = (int)capacity;
+    vm.stack_limit = stack + capacity - STACK_HEADROOM;
+    return true;
+}
+
+// Makes room for 'count' values from 'from' (a pointer into the stack) on.
+// The check is one comparison; only growing is out of line.
+static inline bool reserve_stack(Value * from, size_t count)
+{
+    if ((size_t)(vm.stack_limit - from) >= count) return true;
+    return grow_stack((size_t)(from - vm._stack) + count);
+}
+
+static bool grow_frames()
+{
+    if (vm.frame_capacity >= FRAMES_MAX) return false;
+
+    int capacity = vm.frame_capacity * 2;
+    if (capacity > FRAMES_MAX) capacity = FRAMES_MAX;
+
+    vm.frames = (CallFrame *)realloc(vm.frames, sizeof(CallFrame) * capacity);
+    if (vm.frames == NULL) exit(1);
+    vm.frame_capacity = capacity;
+
+    return true;
+}
+
+// Makes room for one more call frame. Returns false at FRAMES_MAX.
+static inline bool reserve_frame()
+{
+    return vm.frame_count < vm.frame_capacity || grow_frames();
+}
+
 void initVM()
 {
+    vm.stack_capacity = STACK_INITIAL;
+    vm._stack = (Value *)malloc(sizeof(Value) * vm.stack_capacity);
+    vm.stack_limit = vm._stack + STACK_INITIAL - STACK_HEADROOM;
+    vm.frame_capacity = FRAMES_INITIAL;
+    vm.frames = (CallFrame *)malloc(sizeof(CallFrame) * vm.frame_capacity);
+    if (vm._stack == NULL || vm.frames == NULL) exit(1);
+
     reset_stack();
+    vm.register_mode = false;
     vm.objects = NULL;
 
+    vm.bytes_allocated = 0;
+    vm.next_gc = GC_MIN_HEAP;
+    vm.gray_count = 0;
+    vm.gray_capacity = 0;
+    vm.gray_stack = NULL;
+
+    vm.gc_count = 0;
+    vm.gc_total_pause = vm.gc_max_pause = 0;
+
+    vm.strings.init();
+    vm.global_slots.init();
+    vm.global_names.init();
+    vm.global_values.init();
+
     define_native("abs", _builtin__abs_, 1);
     define_native("powew", _builtin__pow_, 2);
     define_native("sqwt", _builtin__sqrt_, 1);
@@ -79,9 +199,17 @@ void initVM()
 
 void freeVM()
 {
-    vm.strings.clear();
-    vm.globals.clear();
+    vm.strings.free();
+    vm.global_slots.free();
+    vm.global_names.free();
+    vm.global_values.free();
+    free_input();
+    free_arena();
+    free_profile();
     free_objects();
+
+    free(vm._stack);
+    free(vm.frames);
 }
 
 void push(Value value)
@@ -109,7 +237,15 @@ static bool call(Function * _function, int arg_count)
         return false;
     }
 
-    if (vm.frame_count == FRAMES_MAX)
+    if (_function->source() != NULL && !compile_function(_function))
+    {
+        runtime__error("fwunction does not compiwe.");
+        return false;
+    }
+
+    // The compiler recorded the deepest the function's stack gets, so pushes
+    // within the frame need no check.
+    if (!reserve_frame() || !reserve_stack(vm.stack_top - arg_count - 1, _function->max_stack()))
     {
         runtime__error("stack ovewfwow.");
         return false;
@@ -118,6 +254,7 @@ static bool call(Function * _function, int arg_count)
     CallFrame * frame = &vm.frames[vm.frame_count++];
     frame->_function = _function;
     frame->ip = _function->chunk().ccode();
+    frame->constants = _function->chunk().cconstants().vvalues();
     frame->slots = vm.stack_top - arg_count - 1;
 
     return true;
@@ -155,261 +292,484 @@ static bool call_value(Value callee, int arg_count)
     return false;
 }
 
+// Register VM call: the callee is in 'base[0]' and its arguments follow it,
+// and base[0] becomes the callee's register 0. Registers the callee may read
+// before writing are cleared so the GC never scans a stale value.
+static bool call_registers(Value * base, int arg_count)
+{
+    Value callee = base[0];
+    if (IS_OBJECT(callee))
+    {
+        switch (OBJECT_TYPE(callee))
+        {
+            case O_FUNCTION:
+            {
+                Function * _function = AS_FUNCTION(callee);
+                if (arg_count != _function->arity())
+                {
+                    runtime__error("expected %d awguments but got %d.", _function->arity(), arg_count);
+                    return false;
+                }
+
+                RegChunk * registers = _function->registers();
+                ptrdiff_t base_index = base - vm._stack;
+                if (!reserve_frame() || !reserve_stack(base, registers->frame_size()))
+                {
+                    runtime__error("stack ovewfwow.");
+                    return false;
+                }
+                base = vm._stack + base_index;
+                Value * end = base + registers->frame_size();
+
+                for (Value * slot = base + arg_count + 1; slot < end; slot++) *slot = NULL_VAL;
+
+                // Registers above the callee's that the caller wrote stay
+                // scanned, so they are still valid if the caller reads them
+                // after the call.
+                Value * top = vm.frame_count > 0 ? vm.frames[vm.frame_count - 1].top : vm.stack_top;
+                CallFrame * frame = &vm.frames[vm.frame_count++];
+                frame->_function = _function;
+                frame->pc = registers->rcode();
+                frame->constants = registers->rconstants().vvalues();
+                frame->slots = base;
+                frame->top = end > top ? end : top;
+                return true;
+            }
+
+            case O_NATIVE:
+            {
+                Native * native = AS_NATIVE(callee);
+                if (arg_count != native->arity())
+                {
+                    runtime__error("expected %d awguments but got %d.", native->arity(), arg_count);
+                    return false;
+                }
+                base[0] = native->_function()(arg_count, base + 1);
+                return true;
+            }
+
+            default: break;
+        }
+    }
+
+    runtime__error("can onwy caww fwunctions.");
+    return false;
+}
+
 bool is_falsy(Value value)
 {
-    return (IS_BOOL(value) && !AS_BOOL(value)) || AS_NUMBER(value) == 0;
+    return IS_NULL(value) ||
+           (IS_BOOL(value) && !AS_BOOL(value)) ||
+           (IS_NUMBER(value) && AS_NUMBER(value) == 0) ||
+           (IS_CHAR(value) && AS_CHAR(value) == '\0');
+}
+
+static int operand_length(Value value)
+{
+    return IS_CHAR(value) ? 1 : AS_STRING(value)->length();
 }
 
-static String * char_to_string(Value value)
+static int append_operand(char * destination, Value value)
 {
     if (IS_CHAR(value))
     {
-        String * _string = ALLOCATE_OBJECT(String, O_STRING);
-        char * chars = ALLOCATE(char, 2);
-        chars[0] = value.as.character;
-        chars[1] = '\0';
-
-        _string->chars() = chars;
-        _string->length() = 1;
-        return _string;
+        *destination = AS_CHAR(value);
+        return 1;
     }
 
-    return AS_STRING(value);
+    String * _string = AS_STRING(value);
+    memcpy(destination, _string->chars(), _string->length());
+    return _string->length();
 }
 
-static void concatenate()
+// Joins two strings or chars into a new string. The caller keeps 'a' and 'b'
+// reachable, since allocating the result may collect garbage.
+String * concatenate_operands(Value a, Value b)
 {
-    String * b = char_to_string(pop());
-    String * a = char_to_string(pop());
-
-    int length = a->length() + b->length();
+    int length = operand_length(a) + operand_length(b);
     char * chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars(), a->length());
-    memcpy(chars + a->length(), b->chars(), b->length());
+    int a_length = append_operand(chars, a);
+    append_operand(chars + a_length, b);
     chars[length] = '\0';
 
-    String * result = take_string(chars, length);
+    return take_string(chars, length);
+}
+
+static void concatenate()
+{
+    String * result = concatenate_operands(peek(1), peek(0));
+    pop();
+    pop();
     push(OBJECT_VAL(result));
 }
 
 static String * read_string()
 {
-    int length = -1;
-    char * _string, c;
+    flush_output();
 
-    _string = (char *)malloc(sizeof(char));
+    int length = 0;
+    const char * line = read_line(&length);
+    if (line == NULL) return copy_string("", 0);
 
-    while (scanf("%c", &c) == 1)
-    {
-        _string = GROW_ARRAY(char, _string, (++length) + 1);
-
-        if (c == '\n') break;
-
-        _string[length] = c;
-    }
-
-    fflush(stdin);
-    _string[length] = '\0';
-
-    return take_string(_string, length);
+    return copy_string(line, length);
 }
 
 static double read_number()
 {
-    int length = -1;
-    char * _string, c;
-
-    _string = (char *)malloc(sizeof(char));
+    flush_output();
+    return read_number_line();
+}
 
-    while (scanf("%c", &c) == 1)
-    {
-        _string = GROW_ARRAY(char, _string, (++length) + 1);
+static char read_char()
+{
+    flush_output();
 
-        if (!isdigit(c) && c != '.' && c != '-')
-        {
-            if (c == '\n') break;
-            return 0;
-        }
+    int c = read_byte();
+    return c == EOF ? '\0' : (char)c;
+}
 
-        _string[length] = c;
+static void trace_register_instruction(CallFrame * frame)
+{
+    RegChunk * registers = frame->_function->registers();
+    printf("          ");
+    for (int i = 0; i < registers->frame_size(); i++)
+    {
+        printf("[");
+        print_value(frame->slots[i]);
+        printf("]");
     }
-
-    fflush(stdin);
-    _string[length + 1] = '\0';
-
-    return strtod(_string, NULL);
+    printf("\n");
+    registers->disassemble_instruction((int)(frame->pc - registers->rcode()));
 }
 
-static char read_char()
+static void trace_instruction(CallFrame * frame)
 {
-    char c;
-    scanf("%c", &c);
-    fflush(stdin);
-
-    return c;
+    printf("          ");
+    for (Value * slot = vm._stack; slot < vm.stack_top; slot++)
+    {
+        printf("[");
+        print_value(*slot);
+        printf("]");
+    }
+    printf("\n");
+    frame->_function->chunk().disassemble_instruction((int)(frame->ip - frame->_function->chunk().ccode()));
 }
 
-static InterpretResult run()
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
+// The interpreter loop is instantiated per debugging mode: TRACE traces
+// every instruction for '-e' and PROFILE counts them for '-o'.
+// run_loop<false, false> is the production loop and carries neither.
+//
+// Without no-gcse/no-crossjumping GCC merges the dispatch jumps at the end
+// of every handler back into one, undoing the threading.
+template <bool TRACE, bool PROFILE>
+#if defined(COMPUTED_GOTO) && !defined(__clang__)
+__attribute__((optimize("no-gcse", "no-crossjumping")))
+#endif
+static InterpretResult run_loop()
 {
-    CallFrame * frame = &vm.frames[vm.frame_count - 1];
+    // The hot interpreter state lives in locals so it can stay in registers.
+    // 'frame->ip' and 'vm.stack_top' are only brought up to date by
+    // STORE_FRAME() before anything that looks at them: calls, allocations
+    // (the GC scans the stack), tracing and error reporting.
+    CallFrame * frame;
+    uint8_t * ip;
+    Value * slots;
+    Value * constants;
+    Value * sp = vm.stack_top;
+
+    #define STORE_FRAME() (frame->ip = ip, vm.stack_top = sp)
+    #define LOAD_FRAME() \
+        do \
+        { \
+            frame = &vm.frames[vm.frame_count - 1]; \
+            ip = frame->ip; \
+            slots = frame->slots; \
+            constants = frame->constants; \
+        } while (false)
 
-    #define READ_BYTE()     (*frame->ip++)
-    #define READ_SHORT()    (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-    #define READ_CONSTANT() (frame->_function->chunk().cconstants().vvalues()[READ_BYTE()])
-    #define READ_STRING()   (AS_STRING(READ_CONSTANT()))
-    #define BINARY_OP(value_type, op) \
+    #define PUSH(value)     (*sp++ = (value))
+    #define POP()           (*--sp)
+    #define PEEK(distance)  (sp[-1 - (distance)])
+    #define READ_BYTE()     (*ip++)
+    #define READ_SHORT()    (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+    #define READ_LONG()     (ip += 3, (uint32_t)((ip[-3] << 16) | (ip[-2] << 8) | ip[-1]))
+    #define READ_CONSTANT() (constants[READ_BYTE()])
+    #define RUNTIME_ERROR(...) \
+        do \
+        { \
+            STORE_FRAME(); \
+            runtime__error(__VA_ARGS__); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } while (false)
+    #define GLOBAL_NAME(slot) (AS_CSTRING(vm.global_names.vvalues()[slot]))
+    // Generic binary operator on numbers. After the type check passes, the
+    // instruction is rewritten in the chunk to its quickened form.
+    #define BINARY_OP(value_type, op, quickened) \
         do \
         { \
-            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) \
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) \
             { \
-                runtime__error("Operands must be numbers."); \
-                return INTERPRET_RUNTIME_ERROR; \
+                RUNTIME_ERROR("Operands must be numbers."); \
             } \
-            double b = AS_NUMBER(pop()); \
-            double a = AS_NUMBER(pop()); \
-            push(value_type(a op b)); \
+            ip[-1] = quickened; \
+            double b = AS_NUMBER(POP()); \
+            double a = AS_NUMBER(POP()); \
+            PUSH(value_type(a op b)); \
         } while (false)
+    // Quickened binary operator. On a type miss it reverts to the generic
+    // instruction and steps back so that one runs instead.
+    #define NUMBER_OP(value_type, op, generic) \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) \
+        { \
+            ip[-1] = generic; \
+            ip--; \
+        } \
+        else \
+        { \
+            double b = AS_NUMBER(POP()); \
+            PEEK(0) = value_type(AS_NUMBER(PEEK(0)) op b); \
+        }
+    // Pops both operands and jumps 'offset' forward when 'a op b' is 'when'.
+    #define COMPARE_JUMP(op, when, offset) \
+        do \
+        { \
+            if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) \
+            { \
+                RUNTIME_ERROR("Operands must be numbers."); \
+            } \
+            double b = AS_NUMBER(POP()); \
+            double a = AS_NUMBER(POP()); \
+            if ((a op b) == when) ip += offset; \
+        } while (false)
+
+    LOAD_FRAME();
+
+#ifdef COMPUTED_GOTO
+    static void * dispatch_table[] =
+    {
+        &&L_OP_CONSTANT,
+        &&L_OP_TRUE,
+        &&L_OP_FALSE,
+        &&L_OP_POP,
+        &&L_OP_GET_GLOBAL,
+        &&L_OP_SET_GLOBAL,
+        &&L_OP_GET_LOCAL,
+        &&L_OP_SET_LOCAL,
+        &&L_OP_DEFINE_GLOBAL,
+        &&L_OP_EQUAL,
+        &&L_OP_NOT_EQUAL,
+        &&L_OP_GREATER,
+        &&L_OP_GREATER_EQUAL,
+        &&L_OP_LESS,
+        &&L_OP_LESS_EQUAL,
+        &&L_OP_ADD,
+        &&L_OP_SUBTRACT,
+        &&L_OP_MULTIPLY,
+        &&L_OP_DIVIDE,
+        &&L_OP_NOT,
+        &&L_OP_NEGATE,
+        &&L_OP_PRINT,
+        &&L_OP_READ_STRING,
+        &&L_OP_READ_NUMBER,
+        &&L_OP_READ_CHAR,
+        &&L_OP_NEW_LINE,
+        &&L_OP_JUMP,
+        &&L_OP_JUMP_IF_TRUE,
+        &&L_OP_JUMP_IF_FALSE,
+        &&L_OP_LOOP,
+        &&L_OP_NULL,
+        &&L_OP_CALL,
+        &&L_OP_TAIL_CALL,
+        &&L_OP_OUT,
+        &&L_OP_INCREMENT_LOCAL,
+        &&L_OP_POPN,
+        &&L_OP_JUMP_IF_EQUAL,
+        &&L_OP_JUMP_IF_NOT_EQUAL,
+        &&L_OP_JUMP_IF_GREATER,
+        &&L_OP_JUMP_IF_NOT_GREATER,
+        &&L_OP_JUMP_IF_GREATER_EQUAL,
+        &&L_OP_JUMP_IF_NOT_GREATER_EQUAL,
+        &&L_OP_JUMP_IF_LESS,
+        &&L_OP_JUMP_IF_NOT_LESS,
+        &&L_OP_JUMP_IF_LESS_EQUAL,
+        &&L_OP_JUMP_IF_NOT_LESS_EQUAL,
+        &&L_OP_ADD_NUMBER,
+        &&L_OP_SUBTRACT_NUMBER,
+        &&L_OP_MULTIPLY_NUMBER,
+        &&L_OP_DIVIDE_NUMBER,
+        &&L_OP_GREATER_NUMBER,
+        &&L_OP_GREATER_EQUAL_NUMBER,
+        &&L_OP_LESS_NUMBER,
+        &&L_OP_LESS_EQUAL_NUMBER,
+        &&L_OP_WIDE,
+    };
+    static_assert(sizeof(dispatch_table) / sizeof(dispatch_table[0]) == OP_COUNT,
+                  "dispatch table out of sync with OpCode");
+
+    #define TARGET(op) L_##op
+    #define DISPATCH() \
+        do \
+        { \
+            if (TRACE) \
+            { \
+                STORE_FRAME(); \
+                trace_instruction(frame); \
+            } \
+            if (PROFILE) profile_instruction(frame->_function, ip); \
+            goto *dispatch_table[READ_BYTE()]; \
+        } while (false)
+
+    DISPATCH();
+#else
+    #define TARGET(op) case op
+    #define DISPATCH() continue
 
     while (true)
     {
-        if (DEBUG_TRACE_EXECUTION)
+        if (TRACE)
         {
-            printf("          ");
-            for (Value * slot = vm._stack; slot < vm.stack_top; slot++)
-            {
-                printf("[");
-                print_value(*slot);
-                printf("]");
-            }
-            printf("\n");
-            frame->_function->chunk().disassemble_instruction((int)(frame->ip - frame->_function->chunk().ccode()));
+            STORE_FRAME();
+            trace_instruction(frame);
         }
+        if (PROFILE) profile_instruction(frame->_function, ip);
 
-        uint8_t instruction;
-        switch (instruction = READ_BYTE())
+        switch (READ_BYTE())
         {
-            case OP_CONSTANT:
-            {
-                Value constant = READ_CONSTANT();
-                push(constant);
-                break;
-            }
-
-            case OP_TRUE:  push(BOOL_VAL(true));  break;
-            case OP_FALSE: push(BOOL_VAL(false)); break;
+#endif
+    TARGET(OP_CONSTANT):
+    {
+        Value constant = READ_CONSTANT();
+        PUSH(constant);
+        DISPATCH();
+    }
 
-            case OP_POP: pop(); break;
+    TARGET(OP_TRUE):  PUSH(BOOL_VAL(true));  DISPATCH();
+    TARGET(OP_FALSE): PUSH(BOOL_VAL(false)); DISPATCH();
 
-            case OP_GET_LOCAL:
-            {
-                uint8_t slot = READ_BYTE();
-                push(frame->slots[slot]);
-                break;
-            }
+    TARGET(OP_POP): sp--; DISPATCH();
 
-            case OP_SET_LOCAL:
-            {
-                uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
-                break;
-            }
-
-            case OP_GET_GLOBAL:
-            {
-                String * name = READ_STRING();
-                auto _iterator = vm.globals.find(name);
-                if (_iterator == vm.globals.end())
-                {
-                    runtime__error("unexpected towken '%s'.", name->chars());
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                Value value = _iterator->second;
-                push(value);
-                break;
-            }
+    TARGET(OP_GET_LOCAL):
+    {
+        uint8_t slot = READ_BYTE();
+        PUSH(slots[slot]);
+        DISPATCH();
+    }
 
-            case OP_SET_GLOBAL:
-            {
-                String * name = READ_STRING();
-                auto _iterator = vm.globals.find(name);
-                if (_iterator == vm.globals.end())
-                {
-                    runtime__error("unexpected towken '%s'.", name->chars());
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                _iterator->second = peek(0);
-                break;
-            }
+    TARGET(OP_SET_LOCAL):
+    {
+        uint8_t slot = READ_BYTE();
+        slots[slot] = PEEK(0);
+        DISPATCH();
+    }
 
-            case OP_DEFINE_GLOBAL:
-            {
-                String * name = READ_STRING();
-                vm.globals.insert(std::make_pair(name, peek(0)));
-                pop();
-                break;
-            }
+    TARGET(OP_GET_GLOBAL):
+    {
+        uint16_t slot = READ_SHORT();
+        Value value = vm.global_values.vvalues()[slot];
+        if (IS_UNDEFINED(value))
+        {
+            RUNTIME_ERROR("unexpected towken '%s'.", GLOBAL_NAME(slot));
+        }
+        PUSH(value);
+        DISPATCH();
+    }
 
-            case OP_EQUAL:
-            {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(values_equal(a, b)));
-                break;
-            }
+    TARGET(OP_SET_GLOBAL):
+    {
+        uint16_t slot = READ_SHORT();
+        Value * global = &vm.global_values.vvalues()[slot];
+        if (IS_UNDEFINED(*global))
+        {
+            RUNTIME_ERROR("unexpected towken '%s'.", GLOBAL_NAME(slot));
+        }
+        *global = PEEK(0);
+        DISPATCH();
+    }
 
-            case OP_NOT_EQUAL:
-            {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(!values_equal(a, b)));
-                break;
-            }
+    TARGET(OP_DEFINE_GLOBAL):
+    {
+        uint16_t slot = READ_SHORT();
+        vm.global_values.vvalues()[slot] = PEEK(0);
+        sp--;
+        DISPATCH();
+    }
 
-            case OP_GREATER:       BINARY_OP(BOOL_VAL, >);   break;
-            case OP_GREATER_EQUAL: BINARY_OP(BOOL_VAL, >=);  break;
-            case OP_LESS:          BINARY_OP(BOOL_VAL, <);   break;
-            case OP_LESS_EQUAL:    BINARY_OP(BOOL_VAL, <=);  break;
+    TARGET(OP_EQUAL):
+    {
+        Value b = POP();
+        Value a = POP();
+        PUSH(BOOL_VAL(values_equal(a, b)));
+        DISPATCH();
+    }
 
-            case OP_ADD:
-            {
-                if ((IS_STRING(peek(0)) || IS_CHAR(peek(0))) && (IS_STRING(peek(1)) || IS_CHAR(peek(1))))
-                {
-                    concatenate();
-                }
-                else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
-                {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
-                }
-                else
-                {
-                    runtime__error("opewands m-must b-be of same twype.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                break;
-            }
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-            case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
+    TARGET(OP_NOT_EQUAL):
+    {
+        Value b = POP();
+        Value a = POP();
+        PUSH(BOOL_VAL(!values_equal(a, b)));
+        DISPATCH();
+    }
 
-            case OP_NOT:
-                push(BOOL_VAL(is_falsy(pop())));
-                break;
+    TARGET(OP_GREATER):       BINARY_OP(BOOL_VAL, >,  OP_GREATER_NUMBER);       DISPATCH();
+    TARGET(OP_GREATER_EQUAL): BINARY_OP(BOOL_VAL, >=, OP_GREATER_EQUAL_NUMBER); DISPATCH();
+    TARGET(OP_LESS):          BINARY_OP(BOOL_VAL, <,  OP_LESS_NUMBER);          DISPATCH();
+    TARGET(OP_LESS_EQUAL):    BINARY_OP(BOOL_VAL, <=, OP_LESS_EQUAL_NUMBER);    DISPATCH();
 
-            case OP_NEGATE:
-            {
-                if (!IS_NUMBER(peek(0)))
-                {
-                    runtime__error("operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
-                break;
-            }
+    TARGET(OP_ADD):
+    {
+        if ((IS_STRING(PEEK(0)) || IS_CHAR(PEEK(0))) && (IS_STRING(PEEK(1)) || IS_CHAR(PEEK(1))))
+        {
+            STORE_FRAME();
+            concatenate();
+            sp = vm.stack_top;
+        }
+        else if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))
+        {
+            ip[-1] = OP_ADD_NUMBER;
+            double b = AS_NUMBER(POP());
+            double a = AS_NUMBER(POP());
+            PUSH(NUMBER_VAL(a + b));
+        }
+        else
+        {
+            RUNTIME_ERROR("opewands m-must b-be of same twype.");
+        }
+        DISPATCH();
+    }
+    TARGET(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUMBER); DISPATCH();
+    TARGET(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUMBER); DISPATCH();
+    TARGET(OP_DIVIDE):   BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUMBER);   DISPATCH();
+
+    TARGET(OP_ADD_NUMBER):           NUMBER_OP(NUMBER_VAL, +,  OP_ADD);           DISPATCH();
+    TARGET(OP_SUBTRACT_NUMBER):      NUMBER_OP(NUMBER_VAL, -,  OP_SUBTRACT);      DISPATCH();
+    TARGET(OP_MULTIPLY_NUMBER):      NUMBER_OP(NUMBER_VAL, *,  OP_MULTIPLY);      DISPATCH();
+    TARGET(OP_DIVIDE_NUMBER):        NUMBER_OP(NUMBER_VAL, /,  OP_DIVIDE);        DISPATCH();
+    TARGET(OP_GREATER_NUMBER):       NUMBER_OP(BOOL_VAL,   >,  OP_GREATER);       DISPATCH();
+    TARGET(OP_GREATER_EQUAL_NUMBER): NUMBER_OP(BOOL_VAL,   >=, OP_GREATER_EQUAL); DISPATCH();
+    TARGET(OP_LESS_NUMBER):          NUMBER_OP(BOOL_VAL,   <,  OP_LESS);          DISPATCH();
+    TARGET(OP_LESS_EQUAL_NUMBER):    NUMBER_OP(BOOL_VAL,   <=, OP_LESS_EQUAL);    DISPATCH();
+
+    TARGET(OP_NOT):
+        PEEK(0) = BOOL_VAL(is_falsy(PEEK(0)));
+        DISPATCH();
+
+    TARGET(OP_NEGATE):
+    {
+        if (!IS_NUMBER(PEEK(0)))
+        {
+            RUNTIME_ERROR("operand must be a number.");
+        }
+        PEEK(0) = NUMBER_VAL(-AS_NUMBER(PEEK(0)));
+        DISPATCH();
+    }
 
-            case OP_PRINT:
-            {
+    TARGET(OP_PRINT):
+    {
 //                uint16_t n = READ_SHORT();
 //                int i = 0;
 //                while (i < n / 2)
@@ -422,110 +782,706 @@ static InterpretResult run()
 //                i = 0;
 //                while (i < n)
 //                {
-//                    print_value(pop());
+//                    print_value(POP());
 //                    i++;
 //                }
 //                break;
 
-                print_value(pop());
-                break;
-            }
+        print_value(POP());
+        DISPATCH();
+    }
+
+    TARGET(OP_READ_STRING):
+    {
+        STORE_FRAME();
+        String * _string = read_string();
+        PUSH(OBJECT_VAL(_string));
+        DISPATCH();
+    }
+
+    TARGET(OP_READ_NUMBER):
+    {
+        STORE_FRAME();
+        Value _number = NUMBER_VAL(read_number());
+        PUSH(_number);
+        DISPATCH();
+    }
+
+    TARGET(OP_READ_CHAR):
+    {
+        Value _char = CHAR_VAL(read_char());
+        PUSH(_char);
+        DISPATCH();
+    }
+
+    // Reserved: the compiler never emits OP_NEW_LINE.
+    TARGET(OP_NEW_LINE): DISPATCH();
+
+    TARGET(OP_JUMP):
+    {
+        uint16_t offset = READ_SHORT();
+        ip += offset;
+        DISPATCH();
+    }
+
+    TARGET(OP_JUMP_IF_TRUE):
+    {
+        uint16_t offset = READ_SHORT();
+        if (!is_falsy(PEEK(0))) ip += offset;
+        DISPATCH();
+    }
+
+    TARGET(OP_JUMP_IF_FALSE):
+    {
+        uint16_t offset = READ_SHORT();
+        if (is_falsy(PEEK(0))) ip += offset;
+        DISPATCH();
+    }
+
+    TARGET(OP_LOOP):
+    {
+        uint16_t offset = READ_SHORT();
+        ip -= offset;
+        DISPATCH();
+    }
+
+    TARGET(OP_NULL): PUSH(NULL_VAL); DISPATCH();
+
+    TARGET(OP_CALL):
+    {
+        int arg_count = READ_BYTE();
+        STORE_FRAME();
+        if (!call_value(PEEK(arg_count), arg_count))
+        {
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        sp = vm.stack_top;
+        LOAD_FRAME();
+        DISPATCH();
+    }
 
-            case OP_READ_STRING:
+    // The callee and its arguments replace the current frame's window, so a
+    // chain of tail calls runs in one frame. A native is called as usual and
+    // the OP_OUT that always follows returns its result.
+    TARGET(OP_TAIL_CALL):
+    {
+        int arg_count = READ_BYTE();
+        Value callee = PEEK(arg_count);
+        if (IS_OBJECT(callee) && OBJECT_TYPE(callee) == O_FUNCTION)
+        {
+            Function * _function = AS_FUNCTION(callee);
+            if (arg_count != _function->arity())
             {
-                String * _string = read_string();
-                push(OBJECT_VAL(_string));
-                break;
+                RUNTIME_ERROR("expected %d awguments but got %d.", _function->arity(), arg_count);
             }
 
-            case OP_READ_NUMBER:
+            STORE_FRAME();
+            if (_function->source() != NULL && !compile_function(_function))
             {
-                Value _number = NUMBER_VAL(read_number());
-                push(_number);
-                break;
+                RUNTIME_ERROR("fwunction does not compiwe.");
             }
-
-            case OP_READ_CHAR:
+            if (!reserve_stack(slots, _function->max_stack()))
             {
-                Value _char = CHAR_VAL(read_char());
-                push(_char);
-                break;
+                RUNTIME_ERROR("stack ovewfwow.");
             }
+            sp = vm.stack_top;
+            slots = frame->slots;
+
+            memmove(slots, sp - arg_count - 1, sizeof(Value) * (arg_count + 1));
+            sp = slots + arg_count + 1;
+            frame->_function = _function;
+            ip = _function->chunk().ccode();
+            constants = frame->constants = _function->chunk().cconstants().vvalues();
+            DISPATCH();
+        }
 
-            case OP_JUMP:
+        STORE_FRAME();
+        if (!call_value(callee, arg_count))
+        {
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        sp = vm.stack_top;
+        LOAD_FRAME();
+        DISPATCH();
+    }
+
+    TARGET(OP_OUT):
+    {
+        Value result = POP();
+        vm.frame_count--;
+        if (vm.frame_count == 0)
+        {
+            sp--;
+            vm.stack_top = sp;
+            return INTERPRET_OK;
+        }
+
+        sp = slots;
+        PUSH(result);
+
+        LOAD_FRAME();
+        DISPATCH();
+    }
+
+    TARGET(OP_INCREMENT_LOCAL):
+    {
+        uint8_t slot = READ_BYTE();
+        Value b = READ_CONSTANT();
+        Value a = slots[slot];
+        if (IS_NUMBER(a) && IS_NUMBER(b))
+        {
+            slots[slot] = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+        }
+        else if ((IS_STRING(a) || IS_CHAR(a)) && (IS_STRING(b) || IS_CHAR(b)))
+        {
+            PUSH(a);
+            PUSH(b);
+            STORE_FRAME();
+            concatenate();
+            sp = vm.stack_top;
+            slots[slot] = POP();
+        }
+        else
+        {
+            RUNTIME_ERROR("opewands m-must b-be of same twype.");
+        }
+        DISPATCH();
+    }
+
+    TARGET(OP_POPN): sp -= READ_BYTE(); DISPATCH();
+
+    TARGET(OP_JUMP_IF_EQUAL):
+    {
+        uint16_t offset = READ_SHORT();
+        Value b = POP();
+        Value a = POP();
+        if (values_equal(a, b)) ip += offset;
+        DISPATCH();
+    }
+
+    TARGET(OP_JUMP_IF_NOT_EQUAL):
+    {
+        uint16_t offset = READ_SHORT();
+        Value b = POP();
+        Value a = POP();
+        if (!values_equal(a, b)) ip += offset;
+        DISPATCH();
+    }
+
+    TARGET(OP_JUMP_IF_GREATER):            { uint16_t offset = READ_SHORT(); COMPARE_JUMP(>,  true,  offset); DISPATCH(); }
+    TARGET(OP_JUMP_IF_NOT_GREATER):        { uint16_t offset = READ_SHORT(); COMPARE_JUMP(>,  false, offset); DISPATCH(); }
+    TARGET(OP_JUMP_IF_GREATER_EQUAL):      { uint16_t offset = READ_SHORT(); COMPARE_JUMP(>=, true,  offset); DISPATCH(); }
+    TARGET(OP_JUMP_IF_NOT_GREATER_EQUAL):  { uint16_t offset = READ_SHORT(); COMPARE_JUMP(>=, false, offset); DISPATCH(); }
+    TARGET(OP_JUMP_IF_LESS):               { uint16_t offset = READ_SHORT(); COMPARE_JUMP(<,  true,  offset); DISPATCH(); }
+    TARGET(OP_JUMP_IF_NOT_LESS):           { uint16_t offset = READ_SHORT(); COMPARE_JUMP(<,  false, offset); DISPATCH(); }
+    TARGET(OP_JUMP_IF_LESS_EQUAL):         { uint16_t offset = READ_SHORT(); COMPARE_JUMP(<=, true,  offset); DISPATCH(); }
+    TARGET(OP_JUMP_IF_NOT_LESS_EQUAL):     { uint16_t offset = READ_SHORT(); COMPARE_JUMP(<=, false, offset); DISPATCH(); }
+
+    // The prefixed instruction carries a 24-bit operand. Only the instructions
+    // the compiler can widen are handled; they are rare enough that a plain
+    // switch is fine here.
+    TARGET(OP_WIDE):
+    {
+        uint8_t instruction = READ_BYTE();
+        uint32_t operand = READ_LONG();
+        switch (instruction)
+        {
+            case OP_CONSTANT:
+                PUSH(constants[operand]);
+                break;
+            case OP_GET_LOCAL:
+                PUSH(slots[operand]);
+                break;
+            case OP_SET_LOCAL:
+                slots[operand] = PEEK(0);
+                break;
+            case OP_GET_GLOBAL:
             {
-                uint16_t offset = READ_SHORT();
-                frame->ip += offset;
+                Value value = vm.global_values.vvalues()[operand];
+                if (IS_UNDEFINED(value))
+                {
+                    RUNTIME_ERROR("unexpected towken '%s'.", GLOBAL_NAME(operand));
+                }
+                PUSH(value);
                 break;
             }
-
-            case OP_JUMP_IF_TRUE:
+            case OP_SET_GLOBAL:
             {
-                uint16_t offset = READ_SHORT();
-                if (!is_falsy(peek(0))) frame->ip += offset;
+                Value * global = &vm.global_values.vvalues()[operand];
+                if (IS_UNDEFINED(*global))
+                {
+                    RUNTIME_ERROR("unexpected towken '%s'.", GLOBAL_NAME(operand));
+                }
+                *global = PEEK(0);
                 break;
             }
-
+            case OP_DEFINE_GLOBAL:
+                vm.global_values.vvalues()[operand] = PEEK(0);
+                sp--;
+                break;
+            case OP_JUMP:
+                ip += operand;
+                break;
+            case OP_JUMP_IF_TRUE:
+                if (!is_falsy(PEEK(0))) ip += operand;
+                break;
             case OP_JUMP_IF_FALSE:
+                if (is_falsy(PEEK(0))) ip += operand;
+                break;
+            case OP_LOOP:
+                ip -= operand;
+                break;
+            case OP_JUMP_IF_EQUAL:
             {
-                uint16_t offset = READ_SHORT();
-                if (is_falsy(peek(0))) frame->ip += offset;
+                Value b = POP();
+                Value a = POP();
+                if (values_equal(a, b)) ip += operand;
                 break;
             }
-
-            case OP_LOOP:
+            case OP_JUMP_IF_NOT_EQUAL:
             {
-                uint16_t offset = READ_SHORT();
-                frame->ip -= offset;
+                Value b = POP();
+                Value a = POP();
+                if (!values_equal(a, b)) ip += operand;
                 break;
             }
+            case OP_JUMP_IF_GREATER:           COMPARE_JUMP(>,  true,  operand); break;
+            case OP_JUMP_IF_NOT_GREATER:       COMPARE_JUMP(>,  false, operand); break;
+            case OP_JUMP_IF_GREATER_EQUAL:     COMPARE_JUMP(>=, true,  operand); break;
+            case OP_JUMP_IF_NOT_GREATER_EQUAL: COMPARE_JUMP(>=, false, operand); break;
+            case OP_JUMP_IF_LESS:              COMPARE_JUMP(<,  true,  operand); break;
+            case OP_JUMP_IF_NOT_LESS:          COMPARE_JUMP(<,  false, operand); break;
+            case OP_JUMP_IF_LESS_EQUAL:        COMPARE_JUMP(<=, true,  operand); break;
+            case OP_JUMP_IF_NOT_LESS_EQUAL:    COMPARE_JUMP(<=, false, operand); break;
+            default:
+                RUNTIME_ERROR("unknown wide opcode %d.", instruction);
+        }
+        DISPATCH();
+    }
 
-            case OP_NULL: push(NULL_VAL); break;
+#ifndef COMPUTED_GOTO
+        }
+    }
+#endif
+
+    #undef STORE_FRAME
+    #undef LOAD_FRAME
+    #undef PUSH
+    #undef POP
+    #undef PEEK
+    #undef RUNTIME_ERROR
+    #undef READ_BYTE
+    #undef READ_SHORT
+    #undef READ_LONG
+    #undef READ_CONSTANT
+    #undef GLOBAL_NAME
+    #undef BINARY_OP
+    #undef NUMBER_OP
+    #undef COMPARE_JUMP
+    #undef TARGET
+    #undef DISPATCH
+}
 
-            case OP_CALL:
+// The register VM loop ('-r'), instantiated per debugging mode like
+// run_loop(). Operands are read straight from the frame's registers and
+// constants, so there are no pushes and pops; vm.stack_top is only brought
+// up to date (to the frame's top) before calls, allocations and errors.
+template <bool TRACE, bool PROFILE>
+#if defined(COMPUTED_GOTO) && !defined(__clang__)
+__attribute__((optimize("no-gcse", "no-crossjumping")))
+#endif
+static InterpretResult run_register_loop()
+{
+    CallFrame * frame;
+    RegInstruction * pc;
+    Value * slots;
+    Value * constants;
+    RegInstruction * instruction;
+
+    #define STORE_FRAME() (frame->pc = pc, vm.stack_top = frame->top)
+    #define LOAD_FRAME() \
+        do \
+        { \
+            frame = &vm.frames[vm.frame_count - 1]; \
+            pc = frame->pc; \
+            slots = frame->slots; \
+            constants = frame->constants; \
+        } while (false)
+
+    #define R(index)  (slots[index])
+    #define RK(index) ((index) & REG_CONSTANT ? constants[(index) & REG_MAX] : slots[index])
+    #define RUNTIME_ERROR(...) \
+        do \
+        { \
+            STORE_FRAME(); \
+            runtime__error(__VA_ARGS__); \
+            return INTERPRET_RUNTIME_ERROR; \
+        } while (false)
+    #define GLOBAL_NAME(slot) (AS_CSTRING(vm.global_names.vvalues()[slot]))
+    #define BINARY_OP(value_type, op) \
+        do \
+        { \
+            Value b = RK(instruction->b); \
+            Value c = RK(instruction->c); \
+            if (!IS_NUMBER(b) || !IS_NUMBER(c)) \
+            { \
+                RUNTIME_ERROR("Operands must be numbers."); \
+            } \
+            R(instruction->a) = value_type(AS_NUMBER(b) op AS_NUMBER(c)); \
+        } while (false)
+    #define COMPARE_JUMP(op, when) \
+        do \
+        { \
+            Value b = RK(instruction->b); \
+            Value c = RK(instruction->c); \
+            if (!IS_NUMBER(b) || !IS_NUMBER(c)) \
+            { \
+                RUNTIME_ERROR("Operands must be numbers."); \
+            } \
+            if ((AS_NUMBER(b) op AS_NUMBER(c)) == when) pc += (int16_t)instruction->a; \
+        } while (false)
+
+    LOAD_FRAME();
+
+#ifdef COMPUTED_GOTO
+    static void * dispatch_table[] =
+    {
+        &&L_R_MOVE,
+        &&L_R_GET_GLOBAL,
+        &&L_R_SET_GLOBAL,
+        &&L_R_DEFINE_GLOBAL,
+        &&L_R_EQUAL,
+        &&L_R_NOT_EQUAL,
+        &&L_R_GREATER,
+        &&L_R_GREATER_EQUAL,
+        &&L_R_LESS,
+        &&L_R_LESS_EQUAL,
+        &&L_R_ADD,
+        &&L_R_SUBTRACT,
+        &&L_R_MULTIPLY,
+        &&L_R_DIVIDE,
+        &&L_R_NOT,
+        &&L_R_NEGATE,
+        &&L_R_PRINT,
+        &&L_R_READ_STRING,
+        &&L_R_READ_NUMBER,
+        &&L_R_READ_CHAR,
+        &&L_R_JUMP,
+        &&L_R_JUMP_IF_TRUE,
+        &&L_R_JUMP_IF_FALSE,
+        &&L_R_JUMP_IF_EQUAL,
+        &&L_R_JUMP_IF_NOT_EQUAL,
+        &&L_R_JUMP_IF_GREATER,
+        &&L_R_JUMP_IF_NOT_GREATER,
+        &&L_R_JUMP_IF_GREATER_EQUAL,
+        &&L_R_JUMP_IF_NOT_GREATER_EQUAL,
+        &&L_R_JUMP_IF_LESS,
+        &&L_R_JUMP_IF_NOT_LESS,
+        &&L_R_JUMP_IF_LESS_EQUAL,
+        &&L_R_JUMP_IF_NOT_LESS_EQUAL,
+        &&L_R_CALL,
+        &&L_R_TAIL_CALL,
+        &&L_R_OUT,
+    };
+    static_assert(sizeof(dispatch_table) / sizeof(dispatch_table[0]) == R_COUNT,
+                  "dispatch table out of sync with RegOpCode");
+
+    #define TARGET(op) L_##op
+    #define DISPATCH() \
+        do \
+        { \
+            if (TRACE) \
+            { \
+                STORE_FRAME(); \
+                trace_register_instruction(frame); \
+            } \
+            if (PROFILE) profile_register_instruction(frame->_function, pc); \
+            instruction = pc++; \
+            goto *dispatch_table[instruction->op]; \
+        } while (false)
+
+    DISPATCH();
+#else
+    #define TARGET(op) case op
+    #define DISPATCH() continue
+
+    while (true)
+    {
+        if (TRACE)
+        {
+            STORE_FRAME();
+            trace_register_instruction(frame);
+        }
+        if (PROFILE) profile_register_instruction(frame->_function, pc);
+
+        instruction = pc++;
+        switch (instruction->op)
+        {
+#endif
+    TARGET(R_MOVE): R(instruction->a) = RK(instruction->b); DISPATCH();
+
+    TARGET(R_GET_GLOBAL):
+    {
+        Value value = vm.global_values.vvalues()[instruction->b];
+        if (IS_UNDEFINED(value))
+        {
+            RUNTIME_ERROR("unexpected towken '%s'.", GLOBAL_NAME(instruction->b));
+        }
+        R(instruction->a) = value;
+        DISPATCH();
+    }
+
+    TARGET(R_SET_GLOBAL):
+    {
+        Value * global = &vm.global_values.vvalues()[instruction->a];
+        if (IS_UNDEFINED(*global))
+        {
+            RUNTIME_ERROR("unexpected towken '%s'.", GLOBAL_NAME(instruction->a));
+        }
+        *global = RK(instruction->b);
+        DISPATCH();
+    }
+
+    TARGET(R_DEFINE_GLOBAL):
+        vm.global_values.vvalues()[instruction->a] = RK(instruction->b);
+        DISPATCH();
+
+    TARGET(R_EQUAL):
+        R(instruction->a) = BOOL_VAL(values_equal(RK(instruction->b), RK(instruction->c)));
+        DISPATCH();
+    TARGET(R_NOT_EQUAL):
+        R(instruction->a) = BOOL_VAL(!values_equal(RK(instruction->b), RK(instruction->c)));
+        DISPATCH();
+
+    TARGET(R_GREATER):       BINARY_OP(BOOL_VAL, >);  DISPATCH();
+    TARGET(R_GREATER_EQUAL): BINARY_OP(BOOL_VAL, >=); DISPATCH();
+    TARGET(R_LESS):          BINARY_OP(BOOL_VAL, <);  DISPATCH();
+    TARGET(R_LESS_EQUAL):    BINARY_OP(BOOL_VAL, <=); DISPATCH();
+
+    TARGET(R_ADD):
+    {
+        Value b = RK(instruction->b);
+        Value c = RK(instruction->c);
+        if (IS_NUMBER(b) && IS_NUMBER(c))
+        {
+            R(instruction->a) = NUMBER_VAL(AS_NUMBER(b) + AS_NUMBER(c));
+        }
+        else if ((IS_STRING(b) || IS_CHAR(b)) && (IS_STRING(c) || IS_CHAR(c)))
+        {
+            // Both operands are still in registers or constants while the
+            // result is allocated.
+            STORE_FRAME();
+            String * result = concatenate_operands(b, c);
+            R(instruction->a) = OBJECT_VAL(result);
+        }
+        else
+        {
+            RUNTIME_ERROR("opewands m-must b-be of same twype.");
+        }
+        DISPATCH();
+    }
+    TARGET(R_SUBTRACT): BINARY_OP(NUMBER_VAL, -); DISPATCH();
+    TARGET(R_MULTIPLY): BINARY_OP(NUMBER_VAL, *); DISPATCH();
+    TARGET(R_DIVIDE):   BINARY_OP(NUMBER_VAL, /); DISPATCH();
+
+    TARGET(R_NOT):
+        R(instruction->a) = BOOL_VAL(is_falsy(RK(instruction->b)));
+        DISPATCH();
+
+    TARGET(R_NEGATE):
+    {
+        Value b = RK(instruction->b);
+        if (!IS_NUMBER(b))
+        {
+            RUNTIME_ERROR("operand must be a number.");
+        }
+        R(instruction->a) = NUMBER_VAL(-AS_NUMBER(b));
+        DISPATCH();
+    }
+
+    TARGET(R_PRINT): print_value(RK(instruction->b)); DISPATCH();
+
+    TARGET(R_READ_STRING):
+    {
+        STORE_FRAME();
+        String * _string = read_string();
+        R(instruction->a) = OBJECT_VAL(_string);
+        DISPATCH();
+    }
+
+    TARGET(R_READ_NUMBER): R(instruction->a) = NUMBER_VAL(read_number()); DISPATCH();
+    TARGET(R_READ_CHAR):   R(instruction->a) = CHAR_VAL(read_char());     DISPATCH();
+
+    TARGET(R_JUMP): pc += (int16_t)instruction->a; DISPATCH();
+
+    TARGET(R_JUMP_IF_TRUE):
+        if (!is_falsy(RK(instruction->b))) pc += (int16_t)instruction->a;
+        DISPATCH();
+
+    TARGET(R_JUMP_IF_FALSE):
+        if (is_falsy(RK(instruction->b))) pc += (int16_t)instruction->a;
+        DISPATCH();
+
+    TARGET(R_JUMP_IF_EQUAL):
+        if (values_equal(RK(instruction->b), RK(instruction->c))) pc += (int16_t)instruction->a;
+        DISPATCH();
+    TARGET(R_JUMP_IF_NOT_EQUAL):
+        if (!values_equal(RK(instruction->b), RK(instruction->c))) pc += (int16_t)instruction->a;
+        DISPATCH();
+
+    TARGET(R_JUMP_IF_GREATER):           COMPARE_JUMP(>,  true);  DISPATCH();
+    TARGET(R_JUMP_IF_NOT_GREATER):       COMPARE_JUMP(>,  false); DISPATCH();
+    TARGET(R_JUMP_IF_GREATER_EQUAL):     COMPARE_JUMP(>=, true);  DISPATCH();
+    TARGET(R_JUMP_IF_NOT_GREATER_EQUAL): COMPARE_JUMP(>=, false); DISPATCH();
+    TARGET(R_JUMP_IF_LESS):              COMPARE_JUMP(<,  true);  DISPATCH();
+    TARGET(R_JUMP_IF_NOT_LESS):          COMPARE_JUMP(<,  false); DISPATCH();
+    TARGET(R_JUMP_IF_LESS_EQUAL):        COMPARE_JUMP(<=, true);  DISPATCH();
+    TARGET(R_JUMP_IF_NOT_LESS_EQUAL):    COMPARE_JUMP(<=, false); DISPATCH();
+
+    TARGET(R_CALL):
+    {
+        STORE_FRAME();
+        if (!call_registers(&R(instruction->a), instruction->b))
+        {
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        LOAD_FRAME();
+        DISPATCH();
+    }
+
+    TARGET(R_TAIL_CALL):
+    {
+        Value * base = &R(instruction->a);
+        int arg_count = instruction->b;
+        if (IS_OBJECT(base[0]) && OBJECT_TYPE(base[0]) == O_FUNCTION)
+        {
+            Function * _function = AS_FUNCTION(base[0]);
+            if (arg_count != _function->arity())
             {
-                int arg_count = READ_BYTE();
-                if (!call_value(peek(arg_count), arg_count))
-                {
-                    return INTERPRET_RUNTIME_ERROR;
-                }
-                frame = &vm.frames[vm.frame_count - 1];
-                break;
+                RUNTIME_ERROR("expected %d awguments but got %d.", _function->arity(), arg_count);
             }
 
-            case OP_OUT:
+            RegChunk * registers = _function->registers();
+            STORE_FRAME();
+            if (!reserve_stack(slots, registers->frame_size()))
             {
-                Value result = pop();
-                vm.frame_count--;
-                if (vm.frame_count == 0)
-                {
-                    pop();
-                    return INTERPRET_OK;
-                }
+                RUNTIME_ERROR("stack ovewfwow.");
+            }
+            slots = frame->slots;
+            base = &R(instruction->a);
+            Value * end = slots + registers->frame_size();
+
+            memmove(slots, base, sizeof(Value) * (arg_count + 1));
+            for (Value * slot = slots + arg_count + 1; slot < end; slot++) *slot = NULL_VAL;
+            if (end > frame->top) frame->top = end;
+
+            frame->_function = _function;
+            frame->constants = constants = registers->rconstants().vvalues();
+            pc = registers->rcode();
+            DISPATCH();
+        }
 
-                vm.stack_top = frame->slots;
-                push(result);
+        STORE_FRAME();
+        if (!call_registers(base, arg_count))
+        {
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        LOAD_FRAME();
+        DISPATCH();
+    }
 
-                frame = &vm.frames[vm.frame_count - 1];
-                break;
-            }
+    TARGET(R_OUT):
+    {
+        Value result = RK(instruction->b);
+        vm.frame_count--;
+        if (vm.frame_count == 0)
+        {
+            vm.stack_top = slots;
+            return INTERPRET_OK;
         }
+
+        slots[0] = result;
+        LOAD_FRAME();
+        DISPATCH();
     }
 
-    #undef READ_BYTE
-    #undef READ_SHORT
-    #undef READ_CONSTANT
-    #undef READ_STRING
+#ifndef COMPUTED_GOTO
+        }
+    }
+#endif
+
+    #undef STORE_FRAME
+    #undef LOAD_FRAME
+    #undef R
+    #undef RK
+    #undef RUNTIME_ERROR
+    #undef GLOBAL_NAME
     #undef BINARY_OP
+    #undef COMPARE_JUMP
+    #undef TARGET
+    #undef DISPATCH
+}
+
+#ifdef COMPUTED_GOTO
+#pragma GCC diagnostic pop
+#endif
+
+static InterpretResult run_registers()
+{
+    if (DEBUG_TRACE_EXECUTION)
+    {
+        return PROFILE_EXECUTION ? run_register_loop<true, true>() : run_register_loop<true, false>();
+    }
+    return PROFILE_EXECUTION ? run_register_loop<false, true>() : run_register_loop<false, false>();
+}
+
+static InterpretResult run()
+{
+    if (DEBUG_TRACE_EXECUTION)
+    {
+        return PROFILE_EXECUTION ? run_loop<true, true>() : run_loop<true, false>();
+    }
+    return PROFILE_EXECUTION ? run_loop<false, true>() : run_loop<false, false>();
 }
 
-InterpretResult interpret(const char * source)
+InterpretResult interpret(const char * source, const char * path)
 {
-    Function * _function = compile(source);
-    if (!_function) return INTERPRET_COMPILE_ERROR;
+    // The cache holds optimized code and skips the compiler's listing, so
+    // '-n' and '-p' always compile.
+    bool cached = path != NULL && USE_CACHE && OPTIMIZE_CODE && !DEBUG_PRINT_CODE;
+
+    Function * _function = cached ? load_cache(path, source) : NULL;
+    if (_function == NULL)
+    {
+        _function = compile(source);
+        if (!_function) return INTERPRET_COMPILE_ERROR;
+        if (cached) save_cache(path, source, _function);
+    }
 
     push(OBJECT_VAL(_function));
-    call_value(OBJECT_VAL(_function), 0);
 
+    // A cached program may hold stubs, which the register VM cannot run and
+    // '-l' must compile (reporting their errors) before the script starts.
+    if ((REGISTER_VM || !LAZY_COMPILE) && !compile_stubs(_function))
+    {
+        pop();
+        return INTERPRET_COMPILE_ERROR;
+    }
+
+    // '-r': run on the register VM, or fall back to the stack VM when some
+    // function does not fit the register instruction set.
+    vm.register_mode = REGISTER_VM && compile_registers(_function);
+    if (REGISTER_VM && !vm.register_mode)
+    {
+        fprintf(stderr, "wawning: pwogwam too wawge for the wegister VM, running it on the stack VM.\n");
+    }
+
+    if (vm.register_mode)
+    {
+        call_registers(vm.stack_top - 1, 0);
+        return run_registers();
+    }
+
+    call_value(OBJECT_VAL(_function), 0);
     return run();
 }
@@ -1,14 +1,27 @@
 #ifndef VM_H_INCLUDED
 #define VM_H_INCLUDED
 
-#include <unordered_map>
-
 #include "chunk.h"
 #include "object.h"
+#include "table.h"
 #include "natives.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// The call-frame and value stacks start small and grow on call entry, up to
+// these limits (in frames and in values). Build with -DFRAMES_MAX=... or
+// -DSTACK_MAX=... to change them.
+#ifndef FRAMES_MAX
+#define FRAMES_MAX (1 << 20)
+#endif
+#ifndef STACK_MAX
+#define STACK_MAX (1 << 24)
+#endif
+
+#define FRAMES_INITIAL 16
+#define STACK_INITIAL 1024
+
+// Values that may be pushed above a frame's reservation by the runtime itself
+// (an allocation keeping a new string reachable, say).
+#define STACK_HEADROOM 8
 
 typedef enum
 {
@@ -22,31 +35,62 @@ typedef struct
     Function * _function;
     uint8_t * ip;
     Value * slots;
+    Value * constants;
+
+    // Register VM ('-r') only: the next instruction, and the end of the
+    // registers in use by this frame and every frame below it.
+    RegInstruction * pc;
+    Value * top;
 } CallFrame;
 
 typedef struct
 {
     Chunk * chunk;
     uint8_t * ip;
-    Value _stack[STACK_MAX];
+    Value * _stack;
     Value * stack_top;
+    Value * stack_limit;
+    int stack_capacity;
 
-    CallFrame frames[FRAMES_MAX];
+    CallFrame * frames;
     int frame_count;
+    int frame_capacity;
+    bool register_mode;
+
+    Table strings;
+
+    // Globals are addressed by slot. global_slots maps a name to its slot
+    // index, global_names maps the index back for error messages.
+    Table global_slots;
+    ValueArray global_names;
+    ValueArray global_values;
 
-    std::unordered_map<String *, Value> strings;
-    std::unordered_map<String *, Value> globals;
     Object * objects;
+
+    size_t bytes_allocated;
+    size_t next_gc;
+    int gray_count;
+    int gray_capacity;
+    Object ** gray_stack;
+
+    int gc_count;
+    double gc_total_pause;
+    double gc_max_pause;
 } VM;
 
 void initVM();
 void freeVM();
 
 void reset_frame();
+int global_slot(String *);
 
-InterpretResult interpret(const char *);
+// 'path' names the script 'source' was read from, for its bytecode cache.
+InterpretResult interpret(const char *, const char * path = NULL);
 
 void push(Value);
 Value pop();
 
+bool is_falsy(Value);
+String * concatenate_operands(Value, Value);
+
 #endif // VM_H_INCLUDED
@@ -0,0 +1,33 @@
+#!/bin/sh
+# Runs uwu on a terminal (a pty from script(1)) and types one line into it,
+# keeping the terminal open afterwards. An answer must come back before the
+# input ends: a reader that waits for a full block of input never answers.
+#
+# Usage: tests/interactive.sh [path to uwu]
+
+UWU=${1:-./uwu}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+status=0
+
+# expect <name> <typed line> <expected output> <command...>
+expect()
+{
+    name=$1 typed=$2 expected=$3
+    shift 3
+
+    { printf '%s\n' "$typed"; sleep 5; } | timeout 2 script -qec "$*" /dev/null > "$dir/out" 2>&1
+    if grep -q "$expected" "$dir/out"; then
+        echo "ok   $name"
+    else
+        echo "FAIL $name: no '$expected' before the end of input"
+        status=1
+    fi
+}
+
+printf 'uwu n\niwi-d n <<\nouo n * 2 >>\n' > "$dir/read.uwu"
+
+expect "repl"   'ouo 1 + 2 >>' '3'  "$UWU"
+expect "iwi-d"  '21'           '42' "$UWU $dir/read.uwu -c"
+
+exit $status